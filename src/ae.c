@@ -17,9 +17,10 @@
 
 static int processTimeEvents(aeEventLoop *eventLoop);
 
-aeEventLoop *aeCreateEventLoop(void) {
+/* Create an event loop able to track file descriptors up to 'setsize'-1.
+ * The loop grows by itself if greater file descriptors are registered. */
+aeEventLoop *aeCreateEventLoop(int setsize) {
     aeEventLoop *eventLoop;
-    int setsize = 1024;
     int i;
 
     eventLoop = malloc(sizeof(*eventLoop));
@@ -31,10 +32,20 @@ aeEventLoop *aeCreateEventLoop(void) {
         
     eventLoop->setsize = setsize;
     eventLoop->fileEventHead = NULL;
-    eventLoop->timeEventHead = NULL;
+    eventLoop->timeEvents = NULL;
+    eventLoop->numTimeEvents = 0;
+    eventLoop->timeEventsSize = 0;
+    eventLoop->timeEventSlots = NULL;
+    eventLoop->freeTimeEventSlots = NULL;
+    eventLoop->numFreeTimeEventSlots = 0;
+    eventLoop->currentTimeEvent = NULL;
     eventLoop->timeEventNextId = 0;
+    eventLoop->timeEventLoop = 0;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
+    eventLoop->beforesleep = NULL;
+    eventLoop->aftersleep = NULL;
+    eventLoop->dontwait = 0;
     
     if (aeApiCreate(eventLoop) == -1) goto err;
     for (i = 0; i < setsize; i++) {
@@ -53,12 +64,41 @@ err:
 
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    while(eventLoop->numTimeEvents)
+        aeDeleteTimeEvent(eventLoop, eventLoop->timeEvents[0]->id);
+    free(eventLoop->timeEvents);
+    free(eventLoop->timeEventSlots);
+    free(eventLoop->freeTimeEventSlots);
     aeApiFree(eventLoop);
     free(eventLoop->events);
     free(eventLoop->fired);
     free(eventLoop);
 }
 
+/* Resize the file events tables so that file descriptors up to 'setsize'-1
+ * can be registered. Returns AE_ERR if there is some fd in use that would
+ * not fit, or if we are out of memory. */
+int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
+    aeFileEvent *events;
+    aeFiredEvent *fired;
+    int i;
+
+    if (setsize == eventLoop->setsize) return AE_OK;
+    if (eventLoop->maxfd >= setsize) return AE_ERR;
+    if (aeApiResize(eventLoop,setsize) == -1) return AE_ERR;
+    events = realloc(eventLoop->events, sizeof(aeFileEvent)*setsize);
+    if (events == NULL) return AE_ERR;
+    eventLoop->events = events;
+    fired = realloc(eventLoop->fired, sizeof(aeFiredEvent)*setsize);
+    if (fired == NULL) return AE_ERR;
+    eventLoop->fired = fired;
+
+    for (i = eventLoop->setsize; i < setsize; i++)
+        eventLoop->events[i].mask = AE_NONE;
+    eventLoop->setsize = setsize;
+    return AE_OK;
+}
+
 void aeStop(aeEventLoop *eventLoop) {
     eventLoop->stop = 1;
 }
@@ -67,8 +107,14 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
         aeFileProc *proc, void *clientData)
 {
     if (fd >= eventLoop->setsize) {
-        errno = ERANGE;
-        return AE_ERR;
+        /* Grow the tables on demand, doubling them to amortize the cost */
+        int setsize = eventLoop->setsize*2;
+
+        if (setsize <= fd) setsize = fd+1;
+        if (aeResizeSetSize(eventLoop, setsize) == AE_ERR) {
+            errno = ERANGE;
+            return AE_ERR;
+        }
     }
     
     aeFileEvent *fe = &eventLoop->events[fd];
@@ -77,7 +123,7 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
         return AE_ERR;
         
     
-    fe->mask = mask;
+    fe->mask |= mask;
     if (mask & AE_READABLE) fe->rfileProc = proc;
     if (mask & AE_WRITABLE) fe->wfileProc = proc;
     fe->clientData = clientData;
@@ -95,6 +141,8 @@ void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
     aeApiDelEvent(eventLoop, fd, mask);
 
     fe->mask = fe->mask & (~mask);
+    /* AE_EDGE alone doesn't keep the fd registered */
+    if (!(fe->mask & (AE_READABLE|AE_WRITABLE))) fe->mask = AE_NONE;
     if (fd == eventLoop->maxfd && fe->mask == AE_NONE) {
         int j;
         
@@ -105,155 +153,196 @@ void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
     }
 }
 
-static void aeGetTime(long *seconds, long *milliseconds)
+/* Milliseconds from the monotonic clock: unlike gettimeofday() it is not
+ * affected by changes of the system time, so timers can't be delayed or
+ * fired early when the clock is adjusted. */
+static long long aeGetTime(void)
 {
-    struct timeval tv;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+/* Time events are stored in a binary min-heap ordered by the time they are
+ * due, so the nearest timer is always timeEvents[0]. Every event remembers
+ * its position in the heap, so it can be moved or removed in O(log N). */
+static void aeTimerHeapSet(aeEventLoop *eventLoop, int j, aeTimeEvent *te) {
+    eventLoop->timeEvents[j] = te;
+    te->heapindex = j;
+}
+
+static void aeTimerHeapUp(aeEventLoop *eventLoop, int j) {
+    aeTimeEvent *te = eventLoop->timeEvents[j];
 
-    gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec/1000;
+    while(j > 0) {
+        int parent = (j-1)/2;
+
+        if (eventLoop->timeEvents[parent]->when <= te->when) break;
+        aeTimerHeapSet(eventLoop, j, eventLoop->timeEvents[parent]);
+        j = parent;
+    }
+    aeTimerHeapSet(eventLoop, j, te);
 }
 
-static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
-    long cur_sec, cur_ms, when_sec, when_ms;
+static void aeTimerHeapDown(aeEventLoop *eventLoop, int j) {
+    aeTimeEvent *te = eventLoop->timeEvents[j];
+    int n = eventLoop->numTimeEvents;
 
-    aeGetTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds/1000;
-    when_ms = cur_ms + milliseconds%1000;
-    if (when_ms >= 1000) {
-        when_sec ++;
-        when_ms -= 1000;
+    while(1) {
+        int child = j*2+1;
+
+        if (child >= n) break;
+        if (child+1 < n && eventLoop->timeEvents[child+1]->when <
+                           eventLoop->timeEvents[child]->when) child++;
+        if (te->when <= eventLoop->timeEvents[child]->when) break;
+        aeTimerHeapSet(eventLoop, j, eventLoop->timeEvents[child]);
+        j = child;
     }
-    *sec = when_sec;
-    *ms = when_ms;
+    aeTimerHeapSet(eventLoop, j, te);
+}
+
+/* Restore the heap property after the 'when' of an event changed. */
+static void aeTimerHeapFix(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    aeTimerHeapUp(eventLoop, te->heapindex);
+    aeTimerHeapDown(eventLoop, te->heapindex);
+}
+
+static void aeTimerHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    aeTimeEvent *last = eventLoop->timeEvents[--eventLoop->numTimeEvents];
+
+    if (last == te) return;
+    aeTimerHeapSet(eventLoop, te->heapindex, last);
+    aeTimerHeapFix(eventLoop, last);
+}
+
+/* Grow the heap and the slots table, that always have the same size. */
+static int aeGrowTimeEvents(aeEventLoop *eventLoop) {
+    int j, size = eventLoop->timeEventsSize ? eventLoop->timeEventsSize*2 : 16;
+    aeTimeEvent **heap, **slots;
+    int *freeslots;
+
+    heap = realloc(eventLoop->timeEvents, sizeof(aeTimeEvent*)*size);
+    if (heap == NULL) return AE_ERR;
+    eventLoop->timeEvents = heap;
+    slots = realloc(eventLoop->timeEventSlots, sizeof(aeTimeEvent*)*size);
+    if (slots == NULL) return AE_ERR;
+    eventLoop->timeEventSlots = slots;
+    freeslots = realloc(eventLoop->freeTimeEventSlots, sizeof(int)*size);
+    if (freeslots == NULL) return AE_ERR;
+    eventLoop->freeTimeEventSlots = freeslots;
+    /* All the old slots are in use, since the heap was full */
+    for (j = size-1; j >= eventLoop->timeEventsSize; j--) {
+        slots[j] = NULL;
+        freeslots[eventLoop->numFreeTimeEventSlots++] = j;
+    }
+    eventLoop->timeEventsSize = size;
+    return AE_OK;
+}
+
+/* The low 32 bits of the ID are the slot of the event in timeEventSlots,
+ * so aeDeleteTimeEvent() finds it without searching. The high bits count
+ * the created events, so that the ID of a deleted event doesn't match the
+ * next event taking its slot. */
+#define AE_TIME_SLOT(id) ((int)((id) & 0xffffffff))
+
+static void aeReleaseTimeSlot(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    int slot = AE_TIME_SLOT(te->id);
+
+    eventLoop->timeEventSlots[slot] = NULL;
+    eventLoop->freeTimeEventSlots[eventLoop->numFreeTimeEventSlots++] = slot;
 }
 
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc)
 {
-    long long id = eventLoop->timeEventNextId++;
     aeTimeEvent *te;
+    int slot;
 
+    if (eventLoop->numTimeEvents == eventLoop->timeEventsSize &&
+        aeGrowTimeEvents(eventLoop) == AE_ERR) return AE_ERR;
     te = malloc(sizeof(*te));
     if (te == NULL) return AE_ERR;
-    te->id = id;
-    aeAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
+    slot = eventLoop->freeTimeEventSlots[--eventLoop->numFreeTimeEventSlots];
+    eventLoop->timeEventSlots[slot] = te;
+    te->id = ((eventLoop->timeEventNextId++ & 0x7fffffff) << 32) | slot;
+    te->when = aeGetTime() + milliseconds;
+    /* Events created by a timer proc will be processed starting from
+     * the next processTimeEvents() call. */
+    te->loop = eventLoop->timeEventLoop;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->next = eventLoop->timeEventHead;
-    eventLoop->timeEventHead = te;
-    return id;
+    aeTimerHeapSet(eventLoop, eventLoop->numTimeEvents++, te);
+    aeTimerHeapUp(eventLoop, te->heapindex);
+    return te->id;
+}
+
+static void aeFreeTimeEvent(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    aeTimerHeapRemove(eventLoop, te);
+    /* Already released if deleted while its proc was running */
+    if (te->id != AE_DELETED_EVENT_ID) aeReleaseTimeSlot(eventLoop, te);
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    free(te);
 }
 
+/* The event is found by its slot and removed from the heap in O(log N).
+ * The timer whose proc is running is just flagged, and freed by
+ * processTimeEvents() when the proc returns. */
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te, *prev = NULL;
-
-    te = eventLoop->timeEventHead;
-    while(te) {
-        if (te->id == id) {
-            if (prev == NULL)
-                eventLoop->timeEventHead = te->next;
-            else
-                prev->next = te->next;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            free(te);
-            return AE_OK;
-        }
-        prev = te;
-        te = te->next;
+    aeTimeEvent *te;
+
+    if (id < 0 || AE_TIME_SLOT(id) >= eventLoop->timeEventsSize)
+        return AE_ERR;
+    te = eventLoop->timeEventSlots[AE_TIME_SLOT(id)];
+    if (te == NULL || te->id != id)
+        return AE_ERR; /* NO event with the specified ID found */
+    if (te == eventLoop->currentTimeEvent) {
+        aeReleaseTimeSlot(eventLoop, te);
+        te->id = AE_DELETED_EVENT_ID;
+    } else {
+        aeFreeTimeEvent(eventLoop, te);
     }
-    return AE_ERR; /* NO event with the specified ID found */
+    return AE_OK;
 }
 
 /* Search the first timer to fire.
  * This operation is useful to know how many time the select can be
  * put in sleep without to delay any event.
- * If there are no timers NULL is returned.
- *
- * Note that's O(N) since time events are unsorted. */
+ * If there are no timers NULL is returned. */
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
-    }
-    return nearest;
+    return eventLoop->numTimeEvents ? eventLoop->timeEvents[0] : NULL;
 }
 
 /* Process time events */
 static int processTimeEvents(aeEventLoop *eventLoop) {
     int processed = 0;
-    aeTimeEvent *te;
-    long long maxId;
-    time_t now = time(NULL);
-
-    /* If the system clock is moved to the future, and then set back to the
-     * right value, time events may be delayed in a random way. Often this
-     * means that scheduled operations will not be performed soon enough.
-     *
-     * Here we try to detect system clock skews, and force all the time
-     * events to be processed ASAP when this happens: the idea is that
-     * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
-    if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
-    }
-    eventLoop->lastTime = now;
-
-    te = eventLoop->timeEventHead;
-    maxId = eventLoop->timeEventNextId-1;
-    while(te) {
-        long now_sec, now_ms;
-        long long id;
-
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
-        }
-        aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
-            int retval;
-
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            processed++;
-            /* After an event is processed our time event list may
-             * no longer be the same, so we restart from head.
-             * Still we make sure to don't process events registered
-             * by event handlers itself in order to don't loop forever.
-             * To do so we saved the max ID we want to handle.
-             *
-             * FUTURE OPTIMIZATIONS:
-             * Note that this is NOT great algorithmically. Redis uses
-             * a single time event so it's not a problem but the right
-             * way to do this is to add the new elements on head, and
-             * to flag deleted elements in a special way for later
-             * deletion (putting references to the nodes to delete into
-             * another linked list). */
-            if (retval != AE_NOMORE) {
-                aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            } else {
-                aeDeleteTimeEvent(eventLoop, id);
-            }
-            te = eventLoop->timeEventHead;
+    long long loop = ++eventLoop->timeEventLoop;
+    long long now = aeGetTime();
+
+    /* Pop the due timers from the heap. A timer that was already handled in
+     * this call (because it asked to be called again ASAP) or that was
+     * created by a timer proc stops the loop, so we can't loop forever:
+     * the due timers left are processed by the next call. */
+    while(eventLoop->numTimeEvents) {
+        aeTimeEvent *te = eventLoop->timeEvents[0];
+        int retval;
+
+        if (te->when > now || te->loop == loop) break;
+        te->loop = loop;
+        eventLoop->currentTimeEvent = te;
+        retval = te->timeProc(eventLoop, te->id, te->clientData);
+        eventLoop->currentTimeEvent = NULL;
+        processed++;
+        if (retval != AE_NOMORE && te->id != AE_DELETED_EVENT_ID) {
+            te->when = now + retval;
+            aeTimerHeapFix(eventLoop, te);
         } else {
-            te = te->next;
+            aeFreeTimeEvent(eventLoop, te);
         }
     }
     return processed;
@@ -292,21 +381,14 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
         if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
             shortest = aeSearchNearestTimer(eventLoop);
         if (shortest) {
-            long now_sec, now_ms;
-
             /* Calculate the time missing for the nearest
              * timer to fire. */
-            aeGetTime(&now_sec, &now_ms);
+            long long ms = shortest->when - aeGetTime();
+
+            if (ms < 0) ms = 0;
             tvp = &tv;
-            tvp->tv_sec = shortest->when_sec - now_sec;
-            if (shortest->when_ms < now_ms) {
-                tvp->tv_usec = ((shortest->when_ms+1000) - now_ms)*1000;
-                tvp->tv_sec --;
-            } else {
-                tvp->tv_usec = (shortest->when_ms - now_ms)*1000;
-            }
-            if (tvp->tv_sec < 0) tvp->tv_sec = 0;
-            if (tvp->tv_usec < 0) tvp->tv_usec = 0;
+            tvp->tv_sec = ms/1000;
+            tvp->tv_usec = (ms%1000)*1000;
         } else {
             /* If we have to check for events but need to return
              * ASAP because of AE_DONT_WAIT we need to se the timeout
@@ -320,6 +402,8 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             }
         }
         numevents = aeApiPoll(eventLoop, tvp);
+        if (eventLoop->aftersleep != NULL)
+            eventLoop->aftersleep(eventLoop);
         for (j = 0; j < numevents; j++) {
             aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
             int mask = eventLoop->fired[j].mask;
@@ -332,6 +416,8 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             if (fe->mask & mask & AE_READABLE) {
                 rfired = 1;
                 fe->rfileProc(eventLoop,fd,fe->clientData,mask);
+                /* The proc may have grown the table, see aeResizeSetSize() */
+                fe = &eventLoop->events[fd];
             }
             if (fe->mask & mask & AE_WRITABLE) {
                 if (!rfired || fe->wfileProc != fe->rfileProc)
@@ -351,6 +437,24 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 void aeMain(aeEventLoop *eventLoop)
 {
     eventLoop->stop = 0;
-    while (!eventLoop->stop)
-        aeProcessEvents(eventLoop, AE_ALL_EVENTS);
+    while (!eventLoop->stop) {
+        if (eventLoop->beforesleep != NULL)
+            eventLoop->beforesleep(eventLoop);
+        aeProcessEvents(eventLoop, eventLoop->dontwait ?
+            AE_ALL_EVENTS|AE_DONT_WAIT : AE_ALL_EVENTS);
+    }
+}
+
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
+    eventLoop->beforesleep = beforesleep;
+}
+
+void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeAfterSleepProc *aftersleep) {
+    eventLoop->aftersleep = aftersleep;
+}
+
+/* Ask aeMain() to poll without sleeping, for instance because the before
+ * sleep callback left some work for the next iteration. */
+void aeSetDontWait(aeEventLoop *eventLoop, int noWait) {
+    eventLoop->dontwait = noWait;
 }
@@ -17,10 +17,12 @@ struct aeEventLoop;
 typedef void aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
 typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id, void *clientData);
 typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop, void *clientData);
+typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
+typedef void aeAfterSleepProc(struct aeEventLoop *eventLoop);
 
 /* File event structure */
 typedef struct aeFileEvent {
-    int mask; /* one of AE_(READABLE|WRITABLE|EXCEPTION) */
+    int mask; /* one of AE_(READABLE|WRITABLE|EXCEPTION), plus AE_EDGE */
     aeFileProc *rfileProc;
     aeFileProc *wfileProc;
     void *clientData;
@@ -29,12 +31,12 @@ typedef struct aeFileEvent {
 /* Time event structure */
 typedef struct aeTimeEvent {
     long long id; /* time event identifier. */
-    long when_sec; /* seconds */
-    long when_ms; /* milliseconds */
+    long long when; /* monotonic clock, milliseconds */
+    int heapindex; /* position in the timers heap */
+    long long loop; /* processTimeEvents() call that last handled it */
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct aeTimeEvent *next;
 } aeTimeEvent;
 
 typedef struct aeFiredEvent {
@@ -47,13 +49,22 @@ typedef struct aeEventLoop {
     int maxfd;
     int setsize;
     long long timeEventNextId;
-    time_t lastTime;
+    long long timeEventLoop; /* processTimeEvents() calls counter */
     aeFiredEvent *fired;
     aeFileEvent *events;
     aeFileEvent *fileEventHead;
-    aeTimeEvent *timeEventHead;
+    aeTimeEvent **timeEvents; /* binary min-heap ordered by 'when' */
+    int numTimeEvents;
+    int timeEventsSize;
+    aeTimeEvent **timeEventSlots; /* events by id, see aeCreateTimeEvent() */
+    int *freeTimeEventSlots; /* stack of the unused slots */
+    int numFreeTimeEventSlots;
+    aeTimeEvent *currentTimeEvent; /* timer whose proc is running, if any */
     int stop;
     void *apidata; /* This is used for poll */
+    aeBeforeSleepProc *beforesleep;
+    aeAfterSleepProc *aftersleep; /* called before processing the events */
+    int dontwait; /* aeMain() polls without blocking, see aeSetDontWait() */
 } aeEventLoop;
 
 /* Defines */
@@ -64,6 +75,7 @@ typedef struct aeEventLoop {
 #define AE_READABLE 1
 #define AE_WRITABLE 2
 #define AE_EXCEPTION 4
+#define AE_EDGE 8 /* edge triggered notification, where the backend supports it */
 
 #define AE_FILE_EVENTS 1
 #define AE_TIME_EVENTS 2
@@ -71,13 +83,15 @@ typedef struct aeEventLoop {
 #define AE_DONT_WAIT 4
 
 #define AE_NOMORE -1
+#define AE_DELETED_EVENT_ID -1
 
 /* Macros */
 #define AE_NOTUSED(V) ((void) V)
 
 /* Prototypes */
-aeEventLoop *aeCreateEventLoop(void);
+aeEventLoop *aeCreateEventLoop(int setsize);
 void aeDeleteEventLoop(aeEventLoop *eventLoop);
+int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
 void aeStop(aeEventLoop *eventLoop);
 int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
         aeFileProc *proc, void *clientData);
@@ -88,6 +102,9 @@ long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id);
 int aeProcessEvents(aeEventLoop *eventLoop, int flags);
 void aeMain(aeEventLoop *eventLoop);
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
+void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeAfterSleepProc *aftersleep);
+void aeSetDontWait(aeEventLoop *eventLoop, int noWait);
 
 int aeApiCreate(aeEventLoop *eventLoop);
 int aeApiResize(aeEventLoop *eventLoop, int setsize);
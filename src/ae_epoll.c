@@ -1,3 +1,5 @@
+#ifndef USE_IOURING
+
 #include "ae.h"
 #include "ae_epoll.h"
 
@@ -24,8 +26,11 @@ int aeApiCreate(aeEventLoop *eventLoop) {
 
 int aeApiResize(aeEventLoop *eventLoop, int setsize) {
     aeApiState *state = eventLoop->apidata;
+    struct epoll_event *events;
     
-    state->events = realloc(state->events, sizeof(struct epoll_event) * setsize);
+    events = realloc(state->events, sizeof(struct epoll_event) * setsize);
+    if (!events) return -1;
+    state->events = events;
     return 0;
 }
 
@@ -48,6 +53,7 @@ int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
     mask |= eventLoop->events[fd].mask; /*merge old events*/
     if (mask & AE_READABLE) ee.events |= EPOLLIN;
     if (mask & AE_WRITABLE) ee.events |= EPOLLOUT;
+    if (mask & AE_EDGE) ee.events |= EPOLLET;
     ee.data.u64 = 0;
     ee.data.fd = fd;
     if (epoll_ctl(state->epfd, op, fd, &ee) == -1) return -1;
@@ -62,9 +68,10 @@ int aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
     ee.events = 0;
     if (mask & AE_READABLE) ee.events |= EPOLLIN;
     if (mask & AE_WRITABLE) ee.events |= EPOLLOUT;
+    if (mask & AE_EDGE) ee.events |= EPOLLET;
     ee.data.u64 = 0;
     ee.data.fd = fd;
-    if (mask | AE_NONE) {
+    if (mask & (AE_READABLE|AE_WRITABLE)) {
         epoll_ctl(state->epfd, EPOLL_CTL_MOD, fd, &ee);
     } else {
         epoll_ctl(state->epfd, EPOLL_CTL_DEL, fd, &ee);
@@ -106,4 +113,6 @@ int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
 
 char *aeApiName(void) {
     return "epoll";
-}
\ No newline at end of file
+}
+
+#endif
\ No newline at end of file
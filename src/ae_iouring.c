@@ -0,0 +1,249 @@
+/* io_uring based aeApi backend, compiled instead of ae_epoll.c when
+ * building with "make USE_IOURING=yes".
+ *
+ * Interest is expressed with one-shot IORING_OP_POLL_ADD requests, so the
+ * semantic is the same level triggered one of the epoll backend: a poll
+ * that fired is armed again at the next aeApiPoll() if the fd is still
+ * registered. Changes of interest don't cost a syscall like epoll_ctl()
+ * does: the SQEs are only queued, and all of them are submitted together
+ * with the wait for new completions by a single io_uring_enter() call. */
+
+#ifdef USE_IOURING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include "ae.h"
+#include "ae_iouring.h"
+
+#define AE_IOURING_ENTRIES 1024
+#define AE_IOURING_IGNORE UINT64_MAX /* user_data of POLL_REMOVE requests */
+
+static int aeIouringEnter(aeApiState *state, unsigned tosubmit,
+        unsigned mincomplete, unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, state->ringfd, tosubmit,
+                   mincomplete, flags, arg, argsz);
+}
+
+/* Return a free SQE, flushing the queued ones to the kernel if the
+ * submission ring is full. */
+static struct io_uring_sqe *aeIouringGetSqe(aeApiState *state) {
+    unsigned head = __atomic_load_n(state->sqhead, __ATOMIC_ACQUIRE);
+    unsigned tail = *state->sqtail;
+    struct io_uring_sqe *sqe;
+
+    if (tail - head == state->sqentries) {
+        aeIouringEnter(state, state->tosubmit, 0, 0, NULL, 0);
+        state->tosubmit = 0;
+    }
+    sqe = &state->sqes[tail & *state->sqmask];
+    memset(sqe, 0, sizeof(*sqe));
+    state->sqarray[tail & *state->sqmask] = tail & *state->sqmask;
+    __atomic_store_n(state->sqtail, tail+1, __ATOMIC_RELEASE);
+    state->tosubmit++;
+    return sqe;
+}
+
+static uint64_t aeIouringUserData(aeApiState *state, int fd) {
+    return ((uint64_t)state->gen[fd] << 32) | (unsigned)fd;
+}
+
+/* Make the poll request in flight for 'fd' match 'mask', replacing the
+ * current one if any. */
+static void aeIouringArm(aeApiState *state, int fd, int mask) {
+    struct io_uring_sqe *sqe;
+    unsigned events = 0;
+
+    mask &= AE_READABLE|AE_WRITABLE; /* AE_EDGE is not supported */
+    if (state->armed[fd] == mask) return;
+    if (state->armed[fd] != AE_NONE) {
+        sqe = aeIouringGetSqe(state);
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = aeIouringUserData(state, fd);
+        sqe->user_data = AE_IOURING_IGNORE;
+        state->gen[fd]++;
+    }
+    state->armed[fd] = mask;
+    if (mask == AE_NONE) return;
+
+    if (mask & AE_READABLE) events |= POLLIN;
+    if (mask & AE_WRITABLE) events |= POLLOUT;
+    sqe = aeIouringGetSqe(state);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = aeIouringUserData(state, fd);
+}
+
+static void aeIouringFreeState(aeApiState *state) {
+    if (state->sqes) munmap(state->sqes, state->sqessz);
+    if (state->cqring && state->cqring != state->sqring)
+        munmap(state->cqring, state->cqringsz);
+    if (state->sqring) munmap(state->sqring, state->sqringsz);
+    if (state->ringfd != -1) close(state->ringfd);
+    free(state->gen);
+    free(state->armed);
+    free(state);
+}
+
+int aeApiCreate(aeEventLoop *eventLoop) {
+    aeApiState *state = calloc(1, sizeof(aeApiState));
+    struct io_uring_params p;
+
+    if (!state) return -1;
+    state->ringfd = -1;
+    state->gen = calloc(eventLoop->setsize, sizeof(unsigned));
+    state->armed = calloc(eventLoop->setsize, 1);
+    if (!state->gen || !state->armed) goto err;
+
+    memset(&p, 0, sizeof(p));
+    state->ringfd = syscall(__NR_io_uring_setup, AE_IOURING_ENTRIES, &p);
+    if (state->ringfd == -1) goto err;
+    /* We need the timeout argument of io_uring_enter() (Linux 5.11). */
+    if (!(p.features & IORING_FEAT_EXT_ARG)) goto err;
+
+    state->sqringsz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    state->cqringsz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cqringsz > state->sqringsz)
+            state->sqringsz = state->cqringsz;
+        state->cqringsz = state->sqringsz;
+    }
+    state->sqring = mmap(NULL, state->sqringsz, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_SQ_RING);
+    if (state->sqring == MAP_FAILED) {
+        state->sqring = NULL;
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cqring = state->sqring;
+    } else {
+        state->cqring = mmap(NULL, state->cqringsz, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_CQ_RING);
+        if (state->cqring == MAP_FAILED) {
+            state->cqring = NULL;
+            goto err;
+        }
+    }
+    state->sqessz = p.sq_entries*sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL, state->sqessz, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        goto err;
+    }
+
+    state->sqhead = state->sqring + p.sq_off.head;
+    state->sqtail = state->sqring + p.sq_off.tail;
+    state->sqmask = state->sqring + p.sq_off.ring_mask;
+    state->sqarray = state->sqring + p.sq_off.array;
+    state->sqentries = p.sq_entries;
+    state->cqhead = state->cqring + p.cq_off.head;
+    state->cqtail = state->cqring + p.cq_off.tail;
+    state->cqmask = state->cqring + p.cq_off.ring_mask;
+    state->cqes = state->cqring + p.cq_off.cqes;
+
+    eventLoop->apidata = state;
+    return 0;
+
+err:
+    aeIouringFreeState(state);
+    return -1;
+}
+
+int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+    unsigned *gen = realloc(state->gen, sizeof(unsigned)*setsize);
+    unsigned char *armed;
+
+    if (!gen) return -1;
+    state->gen = gen;
+    if (!(armed = realloc(state->armed, setsize))) return -1;
+    state->armed = armed;
+    if (setsize > eventLoop->setsize) {
+        memset(gen+eventLoop->setsize, 0,
+            sizeof(unsigned)*(setsize-eventLoop->setsize));
+        memset(armed+eventLoop->setsize, 0, setsize-eventLoop->setsize);
+    }
+    return 0;
+}
+
+void aeApiFree(aeEventLoop *eventLoop) {
+    aeIouringFreeState(eventLoop->apidata);
+}
+
+int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeIouringArm(eventLoop->apidata, fd, eventLoop->events[fd].mask | mask);
+    return 0;
+}
+
+int aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeIouringArm(eventLoop->apidata, fd, eventLoop->events[fd].mask & (~delmask));
+    return 0;
+}
+
+int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned head, tail, flags = IORING_ENTER_EXT_ARG, wait = 1;
+    int j, numevents = 0;
+
+    /* Polls are one-shot: arm again the fds that fired last time and
+     * still have some event registered. */
+    for (j = 0; j < state->lastfired; j++) {
+        int fd = eventLoop->fired[j].fd;
+
+        if (fd < eventLoop->setsize && state->armed[fd] == AE_NONE)
+            aeIouringArm(state, fd, eventLoop->events[fd].mask);
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    if (tvp) {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec*1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        if (tvp->tv_sec == 0 && tvp->tv_usec == 0) wait = 0;
+    }
+    head = *state->cqhead;
+    tail = __atomic_load_n(state->cqtail, __ATOMIC_ACQUIRE);
+    if (wait && head == tail) flags |= IORING_ENTER_GETEVENTS;
+    if (state->tosubmit || (flags & IORING_ENTER_GETEVENTS)) {
+        aeIouringEnter(state, state->tosubmit, wait, flags, &arg, sizeof(arg));
+        state->tosubmit = 0;
+    }
+
+    tail = __atomic_load_n(state->cqtail, __ATOMIC_ACQUIRE);
+    while(head != tail && numevents < eventLoop->setsize) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cqmask];
+        uint64_t data = cqe->user_data;
+        int fd = data & 0xffffffff, mask = 0;
+
+        head++;
+        /* Skip the completions of POLL_REMOVE and of replaced polls. */
+        if (data == AE_IOURING_IGNORE || fd >= eventLoop->setsize ||
+            data != aeIouringUserData(state, fd)) continue;
+
+        state->armed[fd] = AE_NONE;
+        if (cqe->res < 0 || (cqe->res & (POLLERR|POLLHUP))) {
+            mask = eventLoop->events[fd].mask;
+        } else {
+            if (cqe->res & POLLIN) mask |= AE_READABLE;
+            if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+        }
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cqhead, head, __ATOMIC_RELEASE);
+    state->lastfired = numevents;
+    return numevents;
+}
+
+char *aeApiName(void) {
+    return "io_uring";
+}
+
+#endif
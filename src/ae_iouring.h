@@ -0,0 +1,20 @@
+#ifndef AE_IOURING_H
+#define AE_IOURING_H
+
+#include <linux/io_uring.h>
+
+typedef struct aeApiState {
+    int ringfd;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray, sqentries;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqring, *cqring;
+    size_t sqringsz, cqringsz, sqessz;
+    unsigned tosubmit;      /* SQEs queued since the last io_uring_enter() */
+    int lastfired;          /* Events returned by the previous aeApiPoll() */
+    unsigned *gen;          /* Per fd generation, tags the poll requests */
+    unsigned char *armed;   /* Per fd mask of the poll request in flight */
+} aeApiState;
+
+#endif
@@ -1,8 +1,11 @@
 /* anet.c -- Basic TCP socket stuff made a bit less boring
  * Copyright (C) 2006-2009 Salvatore Sanfilippo <antirez@invece.org> */
 
+#define _GNU_SOURCE /* accept4() */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -154,7 +157,7 @@ int anetWrite(int fd, void *buf, int count)
     return totlen;
 }
 
-int anetTcpServer(char *err, int port, char *bindaddr)
+int anetTcpServer(char *err, int port, char *bindaddr, int backlog)
 {
     int s, on = 1;
     struct sockaddr_in sa;
@@ -178,7 +181,7 @@ int anetTcpServer(char *err, int port, char *bindaddr)
         close(s);
         return ANET_ERR;
     }
-    if (listen(s, 5) == -1) {
+    if (listen(s, backlog) == -1) {
         anetSetError(err, "listen: %s\n", strerror(errno));
         close(s);
         return ANET_ERR;
@@ -186,26 +189,82 @@ int anetTcpServer(char *err, int port, char *bindaddr)
     return s;
 }
 
-int anetAccept(char *err, int serversock, char *ip, int *port)
+/* Listen on the unix socket 'path', replacing a stale socket file left by
+ * a previous instance. If 'perm' is not zero it is used as the mode of the
+ * socket file. */
+int anetUnixServer(char *err, char *path, mode_t perm, int backlog)
+{
+    int s;
+    struct sockaddr_un sa;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        anetSetError(err, "unix socket path too long: %s\n", path);
+        return ANET_ERR;
+    }
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        anetSetError(err, "socket: %s\n", strerror(errno));
+        return ANET_ERR;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    unlink(path);
+
+    if (bind(s, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+        anetSetError(err, "bind: %s\n", strerror(errno));
+        close(s);
+        return ANET_ERR;
+    }
+    if (perm && chmod(path, perm) == -1) {
+        anetSetError(err, "chmod: %s\n", strerror(errno));
+        close(s);
+        return ANET_ERR;
+    }
+    if (listen(s, backlog) == -1) {
+        anetSetError(err, "listen: %s\n", strerror(errno));
+        close(s);
+        return ANET_ERR;
+    }
+    return s;
+}
+
+/* Accept a connection. The returned socket is already non blocking and
+ * close-on-exec, so no further fcntl() calls are needed. */
+static int _anetAccept(char *err, int serversock, struct sockaddr *sa,
+                       socklen_t len)
 {
     int fd;
-    struct sockaddr_in sa;
-    unsigned int saLen;
 
     while(1) {
-        saLen = sizeof(sa);
-        fd = accept(serversock, (struct sockaddr*)&sa, &saLen);
+        fd = accept4(serversock, sa, &len, SOCK_NONBLOCK|SOCK_CLOEXEC);
         if (fd == -1) {
             if (errno == EINTR)
                 continue;
             else {
-                anetSetError(err, "accept: %s\n", strerror(errno));
+                anetSetError(err, "accept4: %s\n", strerror(errno));
                 return ANET_ERR;
             }
         }
         break;
     }
+    return fd;
+}
+
+int anetAccept(char *err, int serversock, char *ip, int *port)
+{
+    int fd;
+    struct sockaddr_in sa;
+
+    fd = _anetAccept(err, serversock, (struct sockaddr*)&sa, sizeof(sa));
+    if (fd == ANET_ERR) return ANET_ERR;
     if (ip) strcpy(ip,inet_ntoa(sa.sin_addr));
     if (port) *port = ntohs(sa.sin_port);
     return fd;
 }
+
+int anetUnixAccept(char *err, int serversock)
+{
+    struct sockaddr_un sa;
+
+    return _anetAccept(err, serversock, (struct sockaddr*)&sa, sizeof(sa));
+}
@@ -1,6 +1,8 @@
 #ifndef ANET_H
 #define ANET_H
 
+#include <sys/types.h>
+
 #define ANET_OK 0
 #define ANET_ERR -1
 #define ANET_ERR_LEN 256
@@ -8,8 +10,10 @@
 int anetTcpConnect(char *err, char *addr, int port);
 int anetRead(int fd, void *buf, int count);
 int anetResolve(char *err, char *host, char *ipbuf);
-int anetTcpServer(char *err, int port, char *bindaddr);
+int anetTcpServer(char *err, int port, char *bindaddr, int backlog);
 int anetAccept(char *err, int serversock, char *ip, int *port);
+int anetUnixServer(char *err, char *path, mode_t perm, int backlog);
+int anetUnixAccept(char *err, int serversock);
 int anetWrite(int fd, void *buf, int count);
 int anetNonBlock(char *err, int fd);
 int anetTcpNoDelay(char *err, int fd);
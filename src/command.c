@@ -14,27 +14,26 @@ void pingCommand(redisClient *c) {
 
 void echoCommand(redisClient *c) {
     redisLog(REDIS_DEBUG, "echoCommand");
-    addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",(int)sdslen(c->argv[1])));
+    addReplyLongLong(c,sdslen(c->argv[1]));
     addReplySds(c,c->argv[1]);
     addReply(c,shared.crlf);
     c->argv[1] = NULL;
 }
 
 void setGenericCommand(redisClient *c, int nx) {
-    int retval;
-    robj *o;
+    dictEntry *de;
+    int existing;
 
-    o = createObject(REDIS_STRING,c->argv[2]);
-    c->argv[2] = NULL;
-    retval = dictAdd(c->dict,c->argv[1],o);
-    if (retval == DICT_ERR) {
-        if (!nx)
-            dictReplace(c->dict,c->argv[1],o);
-        else
-            decrRefCount(o);
-    } else {
-        /* Now the key is in the hash entry, don't free it */
-        c->argv[1] = NULL;
+    de = dictAddOrFind(c->dict,c->argv[1],&existing);
+    if (!existing || !nx) {
+        if (existing) {
+            dictFreeEntryVal(c->dict,de);
+        } else {
+            /* Now the key is in the hash entry, don't free it */
+            c->argv[1] = NULL;
+        }
+        dictSetHashVal(c->dict,de,createObject(REDIS_STRING,c->argv[2]));
+        c->argv[2] = NULL;
     }
     server.dirty++;
     addReply(c,shared.ok);
@@ -62,9 +61,7 @@ void getCommand(redisClient *c) {
             addReplySds(c,
                 sdscatprintf(sdsempty(),"%d\r\n%s\r\n",-((int)strlen(err)),err));
         } else {
-            addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",(int)sdslen(o->ptr)));
-            addReply(c,o);
-            addReply(c,shared.crlf);
+            addReplyBulk(c,o);
         }
     }
 }
@@ -85,16 +82,18 @@ void existsCommand(redisClient *c) {
         addReply(c,shared.one);
 }
 
-void incrDecrCommand(redisClient *c, int incr) {
+void incrDecrCommand(redisClient *c, long long incr) {
     dictEntry *de;
     sds newval;
     long long value;
-    int retval;
+    int existing;
     robj *o;
     
-    de = dictFind(c->dict,c->argv[1]);
-    if (de == NULL) {
+    de = dictAddOrFind(c->dict,c->argv[1],&existing);
+    if (!existing) {
         value = 0;
+        /* Now the key is in the hash entry, don't free it */
+        c->argv[1] = NULL;
     } else {
         robj *o = dictGetEntryVal(de);
         
@@ -108,15 +107,10 @@ void incrDecrCommand(redisClient *c, int incr) {
     }
 
     value += incr;
-    newval = sdscatprintf(sdsempty(),"%lld",value);
+    newval = sdsfromlonglong(value);
     o = createObject(REDIS_STRING,newval);
-    retval = dictAdd(c->dict,c->argv[1],o);
-    if (retval == DICT_ERR) {
-        dictReplace(c->dict,c->argv[1],o);
-    } else {
-        /* Now the key is in the hash entry, don't free it */
-        c->argv[1] = NULL;
-    }
+    if (existing) dictFreeEntryVal(c->dict,de);
+    dictSetHashVal(c->dict,de,o);
     server.dirty++;
     addReply(c,o);
     addReply(c,shared.crlf);
@@ -134,7 +128,7 @@ void selectCommand(redisClient *c) {
     int id = atoi(c->argv[1]);
     
     if (selectDb(c,id) == REDIS_ERR) {
-        addReplySds(c,"-ERR invalid DB index\r\n");
+        addReplySds(c,sdsnew("-ERR invalid DB index\r\n"));
     } else {
         addReply(c,shared.ok);
     }
@@ -155,7 +149,7 @@ void randomkeyCommand(redisClient *c) {
 void keysCommand(redisClient *c) {
     dictIterator *di;
     dictEntry *de;
-    sds keys, reply;
+    sds keys;
     sds pattern = c->argv[1];
     int plen = sdslen(pattern);
 
@@ -171,21 +165,17 @@ void keysCommand(redisClient *c) {
     }
     dictReleaseIterator(di);
     keys = sdstrim(keys," ");
-    reply = sdscatprintf(sdsempty(),"%lu\r\n",sdslen(keys));
-    reply = sdscatlen(reply,keys,sdslen(keys));
-    reply = sdscatlen(reply,"\r\n",2);
-    sdsfree(keys);
-    addReplySds(c,reply);
+    addReplyLongLong(c,sdslen(keys));
+    addReplySds(c,keys);
+    addReply(c,shared.crlf);
 }
 
 void dbsizeCommand(redisClient *c) {
-    addReplySds(c,
-        sdscatprintf(sdsempty(),"%lu\r\n",dictGetHashTableUsed(c->dict)));
+    addReplyLongLong(c,dictGetHashTableUsed(c->dict));
 }
 
 void lastsaveCommand(redisClient *c) {
-    addReplySds(c,
-        sdscatprintf(sdsempty(),"%lu\r\n",server.lastsave));
+    addReplyLongLong(c,server.lastsave);
 }
 
 void saveCommand(redisClient *c) {
@@ -212,6 +202,7 @@ void shutdownCommand(redisClient *c) {
     redisLog(REDIS_WARNING,"User requested shutdown, saving DB...");
     if (saveDb("dump.rdb") == REDIS_OK) {
         redisLog(REDIS_WARNING,"Server exit now, bye bye...");
+        if (server.unixsocket) unlink(server.unixsocket);
         exit(1);
     } else {
         redisLog(REDIS_WARNING,"Error trying to save the DB, can't exit"); 
@@ -221,6 +212,7 @@ void shutdownCommand(redisClient *c) {
 
 void renameGenericCommand(redisClient *c, int nx) {
     dictEntry *de;
+    int existing;
     robj *o;
 
     /* To use the same key as src and dst is probably an error */
@@ -236,16 +228,18 @@ void renameGenericCommand(redisClient *c, int nx) {
     }
     o = dictGetEntryVal(de);
     incrRefCount(o);
-    if (dictAdd(c->dict,c->argv[2],o) == DICT_ERR) {
+    de = dictAddOrFind(c->dict,c->argv[2],&existing);
+    if (existing) {
         if (nx) {
             decrRefCount(o);
             addReplySds(c,sdsnew("-ERR destination key exists\r\n"));
             return;
         }
-        dictReplace(c->dict,c->argv[2],o);
+        dictFreeEntryVal(c->dict,de);
     } else {
         c->argv[2] = NULL;
     }
+    dictSetHashVal(c->dict,de,o);
     dictDelete(c->dict,c->argv[1]);
     server.dirty++;
     addReply(c,shared.ok);
@@ -261,7 +255,7 @@ void renamenxCommand(redisClient *c) {
 
 void moveCommand(redisClient *c) {
     dictEntry *de;
-    sds *key;
+    sds key;
     robj *o;
     dict *src, *dst;
 
@@ -288,16 +282,19 @@ void moveCommand(redisClient *c) {
         return;
     }
 
-    /* Try to add the element to the target DB */
-    key = dictGetEntryKey(de);
+    /* Try to add the element to the target DB. The key of the entry can't
+     * be moved to the target as it may be embedded in the entry. */
+    key = sdsdup(c->argv[1]);
     o = dictGetEntryVal(de);
     if (dictAdd(dst,key,o) == DICT_ERR) {
+        sdsfree(key);
         addReplySds(c,sdsnew("-ERR target DB already contains the moved key\r\n"));
         return;
     }
 
-    /* OK! key moved, free the entry in the source DB */
-    dictDeleteNoFree(src,c->argv[1]);
+    /* OK! key moved, free the entry in the source DB but not the value */
+    incrRefCount(o);
+    dictDelete(src,c->argv[1]);
     server.dirty++;
     addReply(c,shared.ok);
 }
@@ -306,36 +303,29 @@ void pushGenericCommand(redisClient *c, int where) {
     robj *ele, *lobj;
     dictEntry *de;
     list *list;
+    int existing;
     
-    ele = createObject(REDIS_STRING,c->argv[2]);
-    c->argv[2] = NULL;
-
-    de = dictFind(c->dict,c->argv[1]);
-    if (de == NULL) {
+    de = dictAddOrFind(c->dict,c->argv[1],&existing);
+    if (!existing) {
         lobj = createListObject();
-        list = lobj->ptr;
-        if (where == REDIS_HEAD) {
-            if (!listAddNodeHead(list,ele)) oom("listAddNodeHead");
-        } else {
-            if (!listAddNodeTail(list,ele)) oom("listAddNodeTail");
-        }
-        dictAdd(c->dict,c->argv[1],lobj);
+        dictSetHashVal(c->dict,de,lobj);
 
         /* Now the key is in the hash entry, don't free it */
         c->argv[1] = NULL;
     } else {
         lobj = dictGetEntryVal(de);
         if (lobj->type != REDIS_LIST) {
-            decrRefCount(ele);
             addReplySds(c,sdsnew("-ERR push against existing key not holding a list\r\n"));
             return;
         }
-        list = lobj->ptr;
-        if (where == REDIS_HEAD) {
-            if (!listAddNodeHead(list,ele)) oom("listAddNodeHead");
-        } else {
-            if (!listAddNodeTail(list,ele)) oom("listAddNodeTail");
-        }
+    }
+    ele = createObject(REDIS_STRING,c->argv[2]);
+    c->argv[2] = NULL;
+    list = lobj->ptr;
+    if (where == REDIS_HEAD) {
+        if (!listAddNodeHead(list,ele)) oom("listAddNodeHead");
+    } else {
+        if (!listAddNodeTail(list,ele)) oom("listAddNodeTail");
     }
     server.dirty++;
     addReply(c,shared.ok);
@@ -363,7 +353,7 @@ void llenCommand(redisClient *c) {
             addReplySds(c,sdsnew("-1\r\n"));
         } else {
             l = o->ptr;
-            addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",listLength(l)));
+            addReplyLongLong(c,listLength(l));
         }
     }
 }
@@ -391,9 +381,7 @@ void lindexCommand(redisClient *c) {
                 addReply(c,shared.nil);
             } else {
                 robj *ele = listNodeValue(ln);
-                addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",(int)sdslen(ele->ptr)));
-                addReply(c,ele);
-                addReply(c,shared.crlf);
+                addReplyBulk(c,ele);
             }
         }
     }
@@ -425,9 +413,7 @@ void popGenericCommand(redisClient *c, int where) {
                 addReply(c,shared.nil);
             } else {
                 robj *ele = listNodeValue(ln);
-                addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",(int)sdslen(ele->ptr)));
-                addReply(c,ele);
-                addReply(c,shared.crlf);
+                addReplyBulk(c,ele);
                 listDelNode(list,ln);
                 server.dirty++;
             }
@@ -482,12 +468,10 @@ void lrangeCommand(redisClient *c) {
 
             /* Return the result in form of a multi-bulk reply */
             ln = listIndex(list, start);
-            addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",rangelen));
+            addReplyLongLong(c,rangelen);
             for (j = 0; j < rangelen; j++) {
                 ele = listNodeValue(ln);
-                addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",(int)sdslen(ele->ptr)));
-                addReply(c,ele);
-                addReply(c,shared.crlf);
+                addReplyBulk(c,ele);
                 ln = ln->next;
             }
         }
@@ -11,6 +11,8 @@ struct redisCommand {
     int type;
 };
 
+struct redisCommand *lookupCommand(sds name);
+
 void pingCommand(redisClient *c);
 void echoCommand(redisClient *c);
 void setCommand(redisClient *c);
@@ -20,6 +22,7 @@ void delCommand(redisClient *c);
 void existsCommand(redisClient *c);
 void incrCommand(redisClient *c);
 void decrCommand(redisClient *c);
+void incrDecrCommand(redisClient *c, long long incr);
 void selectCommand(redisClient *c);
 void randomkeyCommand(redisClient *c);
 void keysCommand(redisClient *c);
@@ -101,7 +101,7 @@ int saveDb(char *filename) {
     }
     redisLog(REDIS_NOTICE,"DB saved on disk");
     server.dirty = 0;
-    server.lastsave = time(NULL);
+    server.lastsave = server.unixtime;
     return REDIS_OK;
 
 werr:
@@ -118,6 +118,8 @@ int saveDbBackground(char *filename) {
     if ((childpid = fork()) == 0) {
         /* Child */
         close(server.fd);
+        if (server.sofd != -1) close(server.sofd);
+        if (server.mcfd != -1) close(server.mcfd);
         if (saveDb(filename) == REDIS_OK) {
             exit(0);
         } else {
@@ -5,6 +5,13 @@
  * get-random-element operations. Hash tables will auto resize if needed
  * tables of power of two in size are used, collisions are handled by
  * chaining.
+ *
+ * Resizing is incremental: the dict keeps the old and the new table, and
+ * every lookup or update moves one bucket from the first to the second
+ * until the old table is empty, see dictRehash().
+ *
+ * Dicts created with dictCreateFlat() use open addressing instead, see the
+ * "Open addressing tables" section below.
  */
 
 #include <stdio.h>
@@ -12,8 +19,15 @@
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/time.h>
 #include "dict.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /* ---------------------------- Utility funcitons --------------------------- */
 
 static void _dictPanic(const char *fmt, ...)
@@ -29,7 +43,7 @@ static void _dictPanic(const char *fmt, ...)
 
 /* ------------------------- Heap Management Wrappers------------------------ */
 
-static void *_dictAlloc(int size)
+static void *_dictAlloc(size_t size)
 {
     void *p = malloc(size);
     if (p == NULL)
@@ -43,10 +57,21 @@ static void _dictFree(void *ptr) {
 
 /* -------------------------- private prototypes ---------------------------- */
 
-static int _dictExpandIfNeeded(dict *ht);
-static unsigned int _dictNextPower(unsigned int size);
-static int _dictKeyIndex(dict *ht, const void *key);
-static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
+static int _dictExpandIfNeeded(dict *d);
+static unsigned long _dictNextPower(unsigned long size);
+static long _dictKeyIndex(dict *d, const void *key, dictEntry **existing);
+static unsigned long _dictRandom(void);
+static int _dictInit(dict *d, dictType *type, void *privDataPtr);
+static int _dictFlatExpand(dict *d, unsigned long size);
+static int _dictFlatRehash(dict *d, int n);
+static dictEntry *_dictFlatAddOrFind(dict *d, void *key, int *existing);
+static int _dictFlatDelete(dict *d, const void *key, int nofree);
+static void _dictFlatClear(dict *d, dictht *ht);
+static dictEntry *_dictFlatFind(dict *d, dictht *ht, const void *key,
+        uint64_t h, unsigned long *pos);
+static dictEntry *_dictFlatNext(dictIterator *iter);
+static dictEntry *_dictFlatGetRandomKey(dict *d);
+static void _dictFlatPrintStatsHt(dictht *ht);
 
 /* -------------------------- hash functions -------------------------------- */
 
@@ -68,195 +93,512 @@ unsigned int dictIdentityHashFunction(unsigned int key)
     return key;
 }
 
-/* Generic hash function (a popular one from Bernstein).
- * I tested a few and this was the best. */
-unsigned int dictGenHashFunction(const unsigned char *buf, int len) {
-    unsigned int hash = 5381;
+/* Generic hash function. By default it's wyhash (Wang Yi's hash, final
+ * version 4), that reads the keys 8 bytes at a time and mixes them with
+ * 64x64->128 bits multiplications: it's much faster than hashing a byte
+ * at a time on all but the shortest keys, and all the bits of the result
+ * are well distributed. It is seeded at startup, but as it was not
+ * designed against attackers the server can switch to SipHash-2-4 for
+ * untrusted input, that is slower but a keyed PRF: without the seed there
+ * is no way to build keys that collide. */
+static uint8_t dict_hash_function_seed[DICT_HASH_SEED_LEN];
+static int dict_hash_algorithm = DICT_HASH_WYHASH;
+
+/* Set the seed of dictGenHashFunction(). Must be called before any key
+ * is hashed, as the tables are not rehashed with the new seed. */
+void dictSetHashFunctionSeed(const uint8_t *seed) {
+    memcpy(dict_hash_function_seed,seed,DICT_HASH_SEED_LEN);
+}
+
+/* Select DICT_HASH_WYHASH or DICT_HASH_SIPHASH, see above. Like the seed
+ * it can't change once keys were hashed. */
+void dictSetHashAlgorithm(int algorithm) {
+    dict_hash_algorithm = algorithm;
+}
+
+static uint64_t _dictRead64(const uint8_t *p) {
+    uint64_t v;
+
+    memcpy(&v,p,8);
+    return v;
+}
+
+static uint64_t _dictRead32(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v,p,4);
+    return v;
+}
+
+/* Little endian load used by SipHash, whose output is defined for it */
+static uint64_t _dictRead64LE(const uint8_t *p) {
+    return ((uint64_t)p[0]) | ((uint64_t)p[1] << 8) |
+           ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+           ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+/* Full 128 bits product of *a and *b: low half in *a, high half in *b */
+static void _dictMum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = *a;
+
+    r *= *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32;
+    uint64_t la = (uint32_t)*a, lb = (uint32_t)*b, hi, lo;
+    uint64_t rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+
+    lo = t + (rm1 << 32);
+    c += lo < t;
+    hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    *a = lo;
+    *b = hi;
+#endif
+}
+
+static uint64_t _dictMix(uint64_t a, uint64_t b) {
+    _dictMum(&a,&b);
+    return a^b;
+}
+
+static const uint64_t _dictWyp[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static uint64_t _dictWyHash(const uint8_t *p, size_t len, uint64_t seed) {
+    const uint64_t *secret = _dictWyp;
+    uint64_t a, b;
+
+    seed ^= _dictMix(seed^secret[0],secret[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (_dictRead32(p) << 32) | _dictRead32(p+((len>>3)<<2));
+            b = (_dictRead32(p+len-4) << 32) |
+                _dictRead32(p+len-4-((len>>3)<<2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len>>1] << 8) |
+                p[len-1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+
+            do {
+                seed = _dictMix(_dictRead64(p)^secret[1],
+                                _dictRead64(p+8)^seed);
+                see1 = _dictMix(_dictRead64(p+16)^secret[2],
+                                _dictRead64(p+24)^see1);
+                see2 = _dictMix(_dictRead64(p+32)^secret[3],
+                                _dictRead64(p+40)^see2);
+                p += 48;
+                i -= 48;
+            } while(i > 48);
+            seed ^= see1^see2;
+        }
+        while(i > 16) {
+            seed = _dictMix(_dictRead64(p)^secret[1],_dictRead64(p+8)^seed);
+            i -= 16;
+            p += 16;
+        }
+        a = _dictRead64(p+i-16);
+        b = _dictRead64(p+i-8);
+    }
+    a ^= secret[1];
+    b ^= seed;
+    _dictMum(&a,&b);
+    return _dictMix(a^secret[0]^len,b^secret[1]);
+}
+
+#define SIP_ROTL(x,b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND do { \
+    v0 += v1; v1 = SIP_ROTL(v1,13); v1 ^= v0; v0 = SIP_ROTL(v0,32); \
+    v2 += v3; v3 = SIP_ROTL(v3,16); v3 ^= v2; \
+    v0 += v3; v3 = SIP_ROTL(v3,21); v3 ^= v0; \
+    v2 += v1; v1 = SIP_ROTL(v1,17); v1 ^= v2; v2 = SIP_ROTL(v2,32); \
+} while(0)
+
+static uint64_t _dictSipHash(const uint8_t *in, size_t len, const uint8_t *k) {
+    uint64_t k0 = _dictRead64LE(k), k1 = _dictRead64LE(k+8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    uint64_t m, b = ((uint64_t)len) << 56;
+    const uint8_t *end = in+len-(len%8);
+
+    for (; in != end; in += 8) {
+        m = _dictRead64LE(in);
+        v3 ^= m;
+        SIP_ROUND;
+        SIP_ROUND;
+        v0 ^= m;
+    }
+    switch(len & 7) {
+    case 7: b |= ((uint64_t)in[6]) << 48; /* fall through */
+    case 6: b |= ((uint64_t)in[5]) << 40; /* fall through */
+    case 5: b |= ((uint64_t)in[4]) << 32; /* fall through */
+    case 4: b |= ((uint64_t)in[3]) << 24; /* fall through */
+    case 3: b |= ((uint64_t)in[2]) << 16; /* fall through */
+    case 2: b |= ((uint64_t)in[1]) << 8; /* fall through */
+    case 1: b |= ((uint64_t)in[0]); break;
+    case 0: break;
+    }
+    v3 ^= b;
+    SIP_ROUND;
+    SIP_ROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIP_ROUND;
+    SIP_ROUND;
+    SIP_ROUND;
+    SIP_ROUND;
+    return v0^v1^v2^v3;
+}
+
+uint64_t dictGenHashFunction(const void *buf, size_t len) {
+    if (dict_hash_algorithm == DICT_HASH_SIPHASH)
+        return _dictSipHash(buf,len,dict_hash_function_seed);
+    return _dictWyHash(buf,len,_dictRead64(dict_hash_function_seed));
+}
+
+/* Case insensitive hash function (Bernstein's), only used for the tables
+ * of short and trusted strings like the command table. */
+uint64_t dictGenCaseHashFunction(const unsigned char *buf, size_t len) {
+    uint64_t hash = 5381;
 
     while (len--)
-        hash = ((hash << 5) + hash) + (*buf++); /* hash * 33 + c */
+        hash = ((hash << 5) + hash) + (tolower(*buf++)); /* hash * 33 + c */
     return hash;
 }
 
 /* ----------------------------- API implementation ------------------------- */
 
-/* Reset an hashtable already initialized with ht_init().
+/* Reset a hash table already initialized with ht_init().
  * NOTE: This function should only called by ht_destroy(). */
-static void _dictReset(dict *ht)
+static void _dictReset(dictht *ht)
 {
     ht->table = NULL;
+    ht->ctrl = NULL;
+    ht->slots = NULL;
     ht->size = 0;
     ht->sizemask = 0;
     ht->used = 0;
+    ht->growthleft = 0;
+    ht->maxprobe = 0;
 }
 
 /* Create a new hash table */
 dict *dictCreate(dictType *type,
         void *privDataPtr)
 {
-    dict *ht = _dictAlloc(sizeof(*ht));
+    dict *d = _dictAlloc(sizeof(*d));
 
-    _dictInit(ht,type,privDataPtr);
-    return ht;
+    _dictInit(d,type,privDataPtr);
+    return d;
+}
+
+/* Create a new open addressing hash table */
+dict *dictCreateFlat(dictType *type,
+        void *privDataPtr)
+{
+    dict *d = dictCreate(type,privDataPtr);
+
+    d->flat = 1;
+    return d;
 }
 
 /* Initialize the hash table */
-int _dictInit(dict *ht, dictType *type,
+int _dictInit(dict *d, dictType *type,
         void *privDataPtr)
 {
-    _dictReset(ht);
-    ht->type = type;
-    ht->privdata = privDataPtr;
+    _dictReset(&d->ht[0]);
+    _dictReset(&d->ht[1]);
+    d->type = type;
+    d->privdata = privDataPtr;
+    d->rehashidx = -1;
+    d->iterators = 0;
+    d->flat = 0;
     return DICT_OK;
 }
 
 /* Resize the table to the minimal size that contains all the elements,
  * but with the invariant of a USER/BUCKETS ration near to <= 1 */
-int dictResize(dict *ht)
+int dictResize(dict *d)
 {
-    int minimal = ht->used;
+    unsigned long minimal;
 
+    if (dictIsRehashing(d)) return DICT_ERR;
+    minimal = d->ht[0].used;
     if (minimal < DICT_HT_INITIAL_SIZE)
         minimal = DICT_HT_INITIAL_SIZE;
-    return dictExpand(ht, minimal);
+    return dictExpand(d, minimal);
 }
 
-/* Expand or create the hashtable */
-int dictExpand(dict *ht, unsigned int size)
+/* Expand or create the hashtable. Only the new table is allocated here:
+ * the elements are moved from the old one a few buckets at a time by
+ * dictRehash(), so that growing a huge table doesn't block the caller. */
+int dictExpand(dict *d, unsigned long size)
 {
-    dict n; /* the new hashtable */
-    unsigned int realsize = _dictNextPower(size), i;
+    dictht n; /* the new hashtable */
+    unsigned long realsize = _dictNextPower(size);
+
+    if (d->flat) return _dictFlatExpand(d,size);
 
     /* the size is invalid if it is smaller than the number of
-     * elements already inside the hashtable */
-    if (ht->used > size)
+     * elements already inside the hashtable, or if we are already
+     * moving the elements to another table */
+    if (dictIsRehashing(d) || d->ht[0].used > size)
         return DICT_ERR;
 
-    _dictInit(&n, ht->type, ht->privdata);
     n.size = realsize;
     n.sizemask = realsize-1;
     n.table = _dictAlloc(realsize*sizeof(dictEntry*));
+    n.used = 0;
 
     /* Initialize all the pointers to NULL */
     memset(n.table, 0, realsize*sizeof(dictEntry*));
 
-    /* Copy all the elements from the old to the new table:
-     * note that if the old hash table is empty ht->size is zero,
-     * so dictExpand just creates an hash table. */
-    n.used = ht->used;
-    for (i = 0; i < ht->size && ht->used > 0; i++) {
+    /* If the hash table is empty this is just its creation */
+    if (d->ht[0].table == NULL) {
+        d->ht[0] = n;
+        return DICT_OK;
+    }
+
+    /* Otherwise prepare the second table for incremental rehashing */
+    d->ht[1] = n;
+    d->rehashidx = 0;
+    return DICT_OK;
+}
+
+/* Move 'n' buckets of the old table to the new one. Returns 1 if there
+ * are still buckets to move, 0 once the rehashing is complete and the new
+ * table took the place of the old one.
+ *
+ * The empty buckets skipped on the way are not counted as moved, so after
+ * a table shrank a lot a single step could scan most of it: no more than
+ * n*10 empty buckets are visited per call, then we return anyway. */
+int dictRehash(dict *d, int n)
+{
+    int empty_visits = n*10;
+
+    if (!dictIsRehashing(d)) return 0;
+    if (d->flat) return _dictFlatRehash(d,n);
+
+    while(n--) {
         dictEntry *he, *nextHe;
 
-        if (ht->table[i] == NULL) continue;
-        
-        /* For each hash entry on this slot... */
-        he = ht->table[i];
+        /* Check if we already rehashed the whole table... */
+        if (d->ht[0].used == 0) {
+            _dictFree(d->ht[0].table);
+            d->ht[0] = d->ht[1];
+            _dictReset(&d->ht[1]);
+            d->rehashidx = -1;
+            return 0;
+        }
+
+        /* Note that rehashidx can't overflow as we are sure there are
+         * more elements because ht[0].used != 0 */
+        while(d->ht[0].table[d->rehashidx] == NULL) {
+            d->rehashidx++;
+            if (--empty_visits == 0) return 1;
+        }
+        he = d->ht[0].table[d->rehashidx];
+        /* Move all the keys in this bucket from the old to the new table */
         while(he) {
-            unsigned int h;
+            unsigned long h;
 
             nextHe = he->next;
-            /* Get the new element index */
-            h = dictHashKey(ht, he->key) & n.sizemask;
-            he->next = n.table[h];
-            n.table[h] = he;
-            ht->used--;
-            /* Pass to the next element */
+            /* Get the index in the new hash table */
+            h = dictHashKey(d, he->key) & d->ht[1].sizemask;
+            he->next = d->ht[1].table[h];
+            d->ht[1].table[h] = he;
+            d->ht[0].used--;
+            d->ht[1].used++;
             he = nextHe;
         }
+        d->ht[0].table[d->rehashidx] = NULL;
+        d->rehashidx++;
     }
-    assert(ht->used == 0);
-    _dictFree(ht->table);
+    return 1;
+}
 
-    /* Remap the new hashtable in the old */
-    *ht = n;
-    return DICT_OK;
+static long long timeInMilliseconds(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000)+(tv.tv_usec/1000);
 }
 
-/* Add an element to the target hash table */
-int dictAdd(dict *ht, void *key, void *val)
+/* Rehash for about 'ms' milliseconds, in steps of 100 buckets. Called
+ * by the server cron, so that a table nobody touches gets rehashed too. */
+int dictRehashMilliseconds(dict *d, int ms) {
+    long long start = timeInMilliseconds();
+    int rehashes = 0;
+
+    while(dictRehash(d,100)) {
+        rehashes += 100;
+        if (timeInMilliseconds()-start > ms) break;
+    }
+    return rehashes;
+}
+
+/* Perform a single step of rehashing, called by the lookup and update
+ * operations so that the rehashing progresses as the dict is used.
+ * Nothing is done while iterators are running, since moving entries
+ * between the tables would make them miss or repeat elements. */
+static void _dictRehashStep(dict *d) {
+    if (d->iterators == 0) dictRehash(d,1);
+}
+
+/* Add 'key' unless it's already in the table, with a single lookup.
+ * If it was added the new entry is returned with a NULL value, that the
+ * caller must set with dictSetHashVal(), and *existing is set to 0.
+ * Otherwise the entry already holding the key is returned, *existing is
+ * set to 1, and 'key' is not used. This is what dictAdd() and
+ * dictReplace() are built on, and how the callers can update a value or
+ * create it if missing without hashing the key twice.
+ *
+ * NULL is returned if the key is missing and can't be added: this only
+ * happens to flat dicts where a lot of elements are added while iterators
+ * are active, see _dictFlatExpandIfNeeded(). */
+dictEntry *dictAddOrFind(dict *d, void *key, int *existing)
 {
-    int index;
-    dictEntry *entry;
+    long index;
+    dictEntry *entry = NULL;
+    dictht *ht;
+
+    if (d->flat) return _dictFlatAddOrFind(d,key,existing);
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    _dictExpandIfNeeded(d);
 
     /* Get the index of the new element, or -1 if
      * the element already exists. */
-    if ((index = _dictKeyIndex(ht, key)) == -1)
-        return DICT_ERR;
+    if ((index = _dictKeyIndex(d, key, &entry)) == -1) {
+        *existing = 1;
+        return entry;
+    }
 
-    /* Allocates the memory and stores key */
-    entry = _dictAlloc(sizeof(*entry));
+    /* Allocates the memory and stores key. While rehashing new elements
+     * always go in the new table. */
+    ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
+    if (dictIsEmbeddedKey(d, key)) {
+        entry = _dictAlloc(sizeof(*entry)+d->type->keyEmbedSize(key));
+        entry->key = d->type->keyEmbed(entry+1, key);
+        /* The copy replaces the key, that the dict owns without keyDup */
+        if (!d->type->keyDup && d->type->keyDestructor)
+            d->type->keyDestructor(d->privdata, key);
+    } else {
+        entry = _dictAlloc(sizeof(*entry));
+        dictSetHashKey(d, entry, key);
+    }
     entry->next = ht->table[index];
     ht->table[index] = entry;
-
-    /* Set the hash entry fields. */
-    dictSetHashKey(ht, entry, key);
-    dictSetHashVal(ht, entry, val);
+    entry->val = NULL;
     ht->used++;
+    *existing = 0;
+    return entry;
+}
+
+/* Add an element to the target hash table */
+int dictAdd(dict *d, void *key, void *val)
+{
+    int existing;
+    dictEntry *entry = dictAddOrFind(d, key, &existing);
+
+    if (entry == NULL || existing) return DICT_ERR;
+    dictSetHashVal(d, entry, val);
     return DICT_OK;
 }
 
 /* Add an element, discarding the old if the key already exists */
-int dictReplace(dict *ht, void *key, void *val)
+int dictReplace(dict *d, void *key, void *val)
 {
-    dictEntry *entry;
+    dictEntry *entry, auxentry;
+    int existing;
 
-    /* Try to add the element. If the key
-     * does not exists dictAdd will suceed. */
-    if (dictAdd(ht, key, val) == DICT_OK)
+    entry = dictAddOrFind(d, key, &existing);
+    if (entry == NULL) return DICT_ERR;
+    if (!existing) {
+        dictSetHashVal(d, entry, val);
         return DICT_OK;
-    /* It already exists, get the entry */
-    entry = dictFind(ht, key);
-    /* Free the old value and set the new one */
-    dictFreeEntryVal(ht, entry);
-    dictSetHashVal(ht, entry, val);
+    }
+    /* Set the new value before freeing the old one, as they may be the
+     * same object. */
+    auxentry.val = entry->val;
+    dictSetHashVal(d, entry, val);
+    dictFreeEntryVal(d, &auxentry);
     return DICT_OK;
 }
 
 /* Search and remove an element */
-static int dictGenericDelete(dict *ht, const void *key, int nofree)
+static int dictGenericDelete(dict *d, const void *key, int nofree)
 {
-    unsigned int h;
+    uint64_t h;
+    unsigned int table;
     dictEntry *he, *prevHe;
 
-    if (ht->size == 0)
+    if (d->flat) return _dictFlatDelete(d,key,nofree);
+    if (d->ht[0].size == 0)
         return DICT_ERR;
-    h = dictHashKey(ht, key) & ht->sizemask;
-    he = ht->table[h];
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    h = dictHashKey(d, key);
 
-    prevHe = NULL;
-    while(he) {
-        if (dictCompareHashKeys(ht, key, he->key)) {
-            /* Unlink the element from the list */
-            if (prevHe)
-                prevHe->next = he->next;
-            else
-                ht->table[h] = he->next;
-            if (!nofree) {
-                dictFreeEntryKey(ht, he);
-                dictFreeEntryVal(ht, he);
+    for (table = 0; table <= 1; table++) {
+        dictht *ht = &d->ht[table];
+        unsigned long idx = h & ht->sizemask;
+
+        he = ht->table[idx];
+        prevHe = NULL;
+        while(he) {
+            if (dictCompareHashKeys(d, key, he->key)) {
+                /* Unlink the element from the list */
+                if (prevHe)
+                    prevHe->next = he->next;
+                else
+                    ht->table[idx] = he->next;
+                if (!nofree) {
+                    dictFreeEntryKey(d, he);
+                    dictFreeEntryVal(d, he);
+                }
+                _dictFree(he);
+                ht->used--;
+                return DICT_OK;
             }
-            _dictFree(he);
-            ht->used--;
-            return DICT_OK;
+            prevHe = he;
+            he = he->next;
         }
-        prevHe = he;
-        he = he->next;
+        if (!dictIsRehashing(d)) break;
     }
     return DICT_ERR; /* not found */
 }
 
-int dictDelete(dict *ht, const void *key) {
-    return dictGenericDelete(ht,key,0);
+int dictDelete(dict *d, const void *key) {
+    return dictGenericDelete(d,key,0);
 }
 
-int dictDeleteNoFree(dict *ht, const void *key) {
-    return dictGenericDelete(ht,key,1);
+int dictDeleteNoFree(dict *d, const void *key) {
+    return dictGenericDelete(d,key,1);
 }
 
 /* Destroy an entire hash table */
-int _dictClear(dict *ht)
+static int _dictClear(dict *d, dictht *ht)
 {
-    unsigned int i;
+    unsigned long i;
+
+    if (d->flat) {
+        _dictFlatClear(d,ht);
+        return DICT_OK;
+    }
 
     /* Free all the elements */
     for (i = 0; i < ht->size && ht->used > 0; i++) {
@@ -265,8 +607,8 @@ int _dictClear(dict *ht)
         if ((he = ht->table[i]) == NULL) continue;
         while(he) {
             nextHe = he->next;
-            dictFreeEntryKey(ht, he);
-            dictFreeEntryVal(ht, he);
+            dictFreeEntryKey(d, he);
+            dictFreeEntryVal(d, he);
             _dictFree(he);
             ht->used--;
             he = nextHe;
@@ -280,47 +622,71 @@ int _dictClear(dict *ht)
 }
 
 /* Clear & Release the hash table */
-void dictRelease(dict *ht)
+void dictRelease(dict *d)
 {
-    _dictClear(ht);
-    _dictFree(ht);
+    _dictClear(d,&d->ht[0]);
+    _dictClear(d,&d->ht[1]);
+    _dictFree(d);
 }
 
-dictEntry *dictFind(dict *ht, const void *key)
+dictEntry *dictFind(dict *d, const void *key)
 {
     dictEntry *he;
-    unsigned int h;
-
-    if (ht->size == 0) return NULL;
-    h = dictHashKey(ht, key) & ht->sizemask;
-    he = ht->table[h];
-    while(he) {
-        if (dictCompareHashKeys(ht, key, he->key))
-            return he;
-        he = he->next;
+    uint64_t h;
+    unsigned int table;
+
+    if (d->ht[0].size == 0) return NULL;
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    h = dictHashKey(d, key);
+    for (table = 0; table <= 1; table++) {
+        if (d->flat) {
+            he = _dictFlatFind(d, &d->ht[table], key, h, NULL);
+            if (he) return he;
+            if (!dictIsRehashing(d)) return NULL;
+            continue;
+        }
+        he = d->ht[table].table[h & d->ht[table].sizemask];
+        while(he) {
+            if (dictCompareHashKeys(d, key, he->key))
+                return he;
+            he = he->next;
+        }
+        if (!dictIsRehashing(d)) return NULL;
     }
     return NULL;
 }
 
-dictIterator *dictGetIterator(dict *ht)
+dictIterator *dictGetIterator(dict *d)
 {
     dictIterator *iter = _dictAlloc(sizeof(*iter));
 
-    iter->ht = ht;
+    iter->d = d;
+    iter->table = 0;
     iter->index = -1;
     iter->entry = NULL;
     iter->nextEntry = NULL;
+    d->iterators++;
     return iter;
 }
 
 dictEntry *dictNext(dictIterator *iter)
 {
+    if (iter->d->flat) return _dictFlatNext(iter);
     while (1) {
         if (iter->entry == NULL) {
+            dictht *ht = &iter->d->ht[iter->table];
+
             iter->index++;
-            if (iter->index >=
-                    (signed)iter->ht->size) break;
-            iter->entry = iter->ht->table[iter->index];
+            if (iter->index >= (long)ht->size) {
+                if (dictIsRehashing(iter->d) && iter->table == 0) {
+                    iter->table++;
+                    iter->index = 0;
+                    ht = &iter->d->ht[1];
+                } else {
+                    break;
+                }
+            }
+            iter->entry = ht->table[iter->index];
         } else {
             iter->entry = iter->nextEntry;
         }
@@ -336,59 +702,82 @@ dictEntry *dictNext(dictIterator *iter)
 
 void dictReleaseIterator(dictIterator *iter)
 {
+    iter->d->iterators--;
     _dictFree(iter);
 }
 
 /* Return a random entry from the hash table. Useful to
  * implement randomized algorithms */
-dictEntry *dictGetRandomKey(dict *ht)
+dictEntry *dictGetRandomKey(dict *d)
 {
-    dictEntry *he;
-    unsigned int h;
+    dictEntry *he, *orighe;
+    unsigned long h;
     int listlen, listele;
 
-    if (ht->size == 0) return NULL;
-    do {
-        h = random() & ht->sizemask;
-        he = ht->table[h];
-    } while(he == NULL);
+    if (dictSize(d) == 0) return NULL;
+    if (d->flat) return _dictFlatGetRandomKey(d);
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    if (dictIsRehashing(d)) {
+        /* The buckets of the old table below rehashidx are empty */
+        do {
+            h = d->rehashidx +
+                (_dictRandom() % (d->ht[0].size+d->ht[1].size-d->rehashidx));
+            he = (h >= d->ht[0].size) ? d->ht[1].table[h-d->ht[0].size] :
+                                        d->ht[0].table[h];
+        } while(he == NULL);
+    } else {
+        do {
+            h = _dictRandom() & d->ht[0].sizemask;
+            he = d->ht[0].table[h];
+        } while(he == NULL);
+    }
 
     /* Now we found a non empty bucket, but it is a linked
      * list and we need to get a random element from the list.
      * The only sane way to do so is to count the element and
      * select a random index. */
     listlen = 0;
+    orighe = he;
     while(he) {
         he = he->next;
         listlen++;
     }
     listele = random() % listlen;
-    he = ht->table[h];
+    he = orighe;
     while(listele--) he = he->next;
     return he;
 }
 
 /* ------------------------- private functions ------------------------------ */
 
+/* random() only returns 31 bits, not enough to pick a slot of big tables */
+static unsigned long _dictRandom(void)
+{
+    return ((unsigned long)random() << 31) ^ (unsigned long)random();
+}
+
 /* Expand the hash table if needed */
-static int _dictExpandIfNeeded(dict *ht)
+static int _dictExpandIfNeeded(dict *d)
 {
+    /* Incremental rehashing already in progress. Return. */
+    if (dictIsRehashing(d)) return DICT_OK;
+
     /* If the hash table is empty expand it to the intial size,
      * if the table is "full" dobule its size. */
-    if (ht->size == 0)
-        return dictExpand(ht, DICT_HT_INITIAL_SIZE);
-    if (ht->used == ht->size)
-        return dictExpand(ht, ht->size*2);
+    if (d->ht[0].size == 0)
+        return dictExpand(d, DICT_HT_INITIAL_SIZE);
+    if (d->ht[0].used >= d->ht[0].size)
+        return dictExpand(d, d->ht[0].used*2);
     return DICT_OK;
 }
 
 /* Our hash table capability is a power of two */
-static unsigned int _dictNextPower(unsigned int size)
+static unsigned long _dictNextPower(unsigned long size)
 {
-    unsigned int i = DICT_HT_INITIAL_SIZE;
+    unsigned long i = DICT_HT_INITIAL_SIZE;
 
-    if (size >= 2147483648U)
-        return 2147483648U;
+    if (size >= LONG_MAX)
+        return LONG_MAX + 1LU;
     while(1) {
         if (i >= size)
             return i;
@@ -398,32 +787,41 @@ static unsigned int _dictNextPower(unsigned int size)
 
 /* Returns the index of a free slot that can be populated with
  * an hash entry for the given 'key'.
- * If the key already exists, -1 is returned. */
-static int _dictKeyIndex(dict *ht, const void *key)
+ * If the key already exists, -1 is returned and its entry is stored
+ * in *existing.
+ *
+ * Note that if we are in the process of rehashing the hash table, the
+ * index is always returned in the context of the second (new) hash table. */
+static long _dictKeyIndex(dict *d, const void *key, dictEntry **existing)
 {
-    unsigned int h;
+    uint64_t h;
+    unsigned long idx = 0;
+    unsigned int table;
     dictEntry *he;
 
-    /* Expand the hashtable if needed */
-    if (_dictExpandIfNeeded(ht) == DICT_ERR)
-        return -1;
     /* Compute the key hash value */
-    h = dictHashKey(ht, key) & ht->sizemask;
-    /* Search if this slot does not already contain the given key */
-    he = ht->table[h];
-    while(he) {
-        if (dictCompareHashKeys(ht, key, he->key))
-            return -1;
-        he = he->next;
+    h = dictHashKey(d, key);
+    for (table = 0; table <= 1; table++) {
+        idx = h & d->ht[table].sizemask;
+        /* Search if this slot does not already contain the given key */
+        he = d->ht[table].table[idx];
+        while(he) {
+            if (dictCompareHashKeys(d, key, he->key)) {
+                *existing = he;
+                return -1;
+            }
+            he = he->next;
+        }
+        if (!dictIsRehashing(d)) break;
     }
-    return h;
+    return idx;
 }
 
 #define DICT_STATS_VECTLEN 50
-void dictPrintStats(dict *ht) {
-    unsigned int i, slots = 0, chainlen, maxchainlen = 0;
-    unsigned int totchainlen = 0;
-    unsigned int clvector[DICT_STATS_VECTLEN];
+static void _dictPrintStatsHt(dictht *ht) {
+    unsigned long i, slots = 0, chainlen, maxchainlen = 0;
+    unsigned long totchainlen = 0;
+    unsigned long clvector[DICT_STATS_VECTLEN];
 
     if (ht->used == 0) {
         printf("No stats available for empty dictionaries\n");
@@ -451,22 +849,405 @@ void dictPrintStats(dict *ht) {
         totchainlen += chainlen;
     }
     printf("Hash table stats:\n");
-    printf(" table size: %d\n", ht->size);
-    printf(" number of elements: %d\n", ht->used);
-    printf(" different slots: %d\n", slots);
-    printf(" max chain length: %d\n", maxchainlen);
+    printf(" table size: %lu\n", ht->size);
+    printf(" number of elements: %lu\n", ht->used);
+    printf(" different slots: %lu\n", slots);
+    printf(" max chain length: %lu\n", maxchainlen);
     printf(" avg chain length (counted): %.02f\n", (float)totchainlen/slots);
     printf(" avg chain length (computed): %.02f\n", (float)ht->used/slots);
     printf(" Chain length distribution:\n");
     for (i = 0; i < DICT_STATS_VECTLEN-1; i++) {
         if (clvector[i] == 0) continue;
-        printf("   %s%d: %d (%.02f%%)\n",(i == DICT_STATS_VECTLEN-1)?">= ":"", i, clvector[i], ((float)clvector[i]/ht->size)*100);
+        printf("   %s%lu: %lu (%.02f%%)\n",(i == DICT_STATS_VECTLEN-1)?">= ":"", i, clvector[i], ((float)clvector[i]/ht->size)*100);
+    }
+}
+
+void dictPrintStats(dict *d) {
+    void (*printht)(dictht *ht) =
+        d->flat ? _dictFlatPrintStatsHt : _dictPrintStatsHt;
+
+    printht(&d->ht[0]);
+    if (dictIsRehashing(d)) {
+        printf("-- Rehashing into ht[1]:\n");
+        printht(&d->ht[1]);
+    }
+}
+
+/* ------------------------- Open addressing tables -------------------------
+ *
+ * Tables created with dictCreateFlat() store the key and val pointers in
+ * an array of slots instead of separately allocated entries chained from
+ * the buckets, in the style of the "Swiss tables": every slot has a control
+ * byte that is either DICT_CTRL_EMPTY, DICT_CTRL_DELETED, or the 7 lowest
+ * bits of the hash of its key. Slots are probed a group of 16 at a time,
+ * matching all the control bytes of the group at once (with SSE2 when
+ * available), so that only the keys whose 7 bits match are compared. A
+ * lookup usually touches the control bytes of a single group and the slot
+ * of the key, and a key costs 16 bytes plus a control byte, at a load of
+ * at most 7/8, against the 24 bytes entry, its malloc overhead and the
+ * bucket pointer of chained tables.
+ *
+ * Groups are probed with a triangular sequence starting from the group
+ * selected by the upper bits of the hash. A probe sequence stops at the
+ * first group with an empty slot, so deleted slots become tombstones unless
+ * their group already has an empty slot, and they are recycled by the
+ * insertions and dropped by the next rehash. Rehashing is incremental like
+ * for chained tables, moving a group of the old table at a time. */
+
+#define DICT_GROUP_SIZE 16
+#define DICT_CTRL_EMPTY 0x80
+#define DICT_CTRL_DELETED 0xfe
+#define DICT_CTRL_FREE 0x80 /* bit set in empty and deleted control bytes */
+#define DICT_CTRL_HASH(h) ((h) & 0x7f)
+#define DICT_SLOT_SIZE (sizeof(void*)*2)
+
+#define _dictFlatSlot(ht, idx) \
+    ((dictEntry*)((ht)->slots+(size_t)(idx)*DICT_SLOT_SIZE))
+
+#ifdef __SSE2__
+/* Return a bitmask of the slots of the group with the control byte 'c' */
+static unsigned int _dictGroupMatch(const unsigned char *ctrl, unsigned char c)
+{
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group,_mm_set1_epi8((char)c)));
+}
+
+/* Return a bitmask of the empty or deleted slots of the group */
+static unsigned int _dictGroupMatchFree(const unsigned char *ctrl)
+{
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+}
+#else
+static unsigned int _dictGroupMatch(const unsigned char *ctrl, unsigned char c)
+{
+    unsigned int j, mask = 0;
+
+    for (j = 0; j < DICT_GROUP_SIZE; j++)
+        if (ctrl[j] == c) mask |= 1<<j;
+    return mask;
+}
+
+static unsigned int _dictGroupMatchFree(const unsigned char *ctrl)
+{
+    unsigned int j, mask = 0;
+
+    for (j = 0; j < DICT_GROUP_SIZE; j++)
+        if (ctrl[j] & DICT_CTRL_FREE) mask |= 1<<j;
+    return mask;
+}
+#endif
+
+/* Index of the lowest bit set in a non zero mask */
+static int _dictFirstBit(unsigned int mask)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    int j = 0;
+
+    while(!(mask & 1)) {
+        mask >>= 1;
+        j++;
+    }
+    return j;
+#endif
+}
+
+/* Allocate the new table, like dictExpand() but doubling the size if the
+ * current elements would not fit under the maximum load of 7/8. */
+static int _dictFlatExpand(dict *d, unsigned long size)
+{
+    dictht n;
+    unsigned long realsize = _dictNextPower(size);
+
+    if (dictIsRehashing(d) || d->ht[0].used > size)
+        return DICT_ERR;
+    if (d->ht[0].used > realsize-realsize/8) realsize *= 2;
+
+    _dictReset(&n);
+    n.size = realsize;
+    n.sizemask = realsize-1;
+    n.growthleft = realsize-realsize/8;
+    n.ctrl = _dictAlloc(realsize);
+    memset(n.ctrl, DICT_CTRL_EMPTY, realsize);
+    /* The 'next' field of the last entry is never accessed, but as the
+     * slots are accessed as dictEntry make sure it is in the allocation. */
+    n.slots = _dictAlloc((size_t)realsize*DICT_SLOT_SIZE+sizeof(void*));
+
+    if (d->ht[0].ctrl == NULL) {
+        d->ht[0] = n;
+        return DICT_OK;
+    }
+    d->ht[1] = n;
+    d->rehashidx = 0;
+    return DICT_OK;
+}
+
+/* Search 'key' in the table 'ht', storing its slot index in *pos if found.
+ * Besides stopping at groups with an empty slot, the probe never goes past
+ * the longest sequence of an insertion: so a lookup stays short even in
+ * the old table of a rehashing, where the moved groups are full of
+ * tombstones. */
+static dictEntry *_dictFlatFind(dict *d, dictht *ht, const void *key,
+        uint64_t h, unsigned long *pos)
+{
+    unsigned long groupmask = (ht->size/DICT_GROUP_SIZE)-1;
+    unsigned long g = (h >> 7) & groupmask, probe;
+
+    for (probe = 0; probe <= ht->maxprobe; probe++) {
+        unsigned char *ctrl = ht->ctrl+g*DICT_GROUP_SIZE;
+        unsigned int match = _dictGroupMatch(ctrl,DICT_CTRL_HASH(h));
+
+        while(match) {
+            unsigned long idx = g*DICT_GROUP_SIZE+_dictFirstBit(match);
+            dictEntry *he = _dictFlatSlot(ht,idx);
+
+            if (dictCompareHashKeys(d, key, he->key)) {
+                if (pos) *pos = idx;
+                return he;
+            }
+            match &= match-1;
+        }
+        if (_dictGroupMatch(ctrl,DICT_CTRL_EMPTY)) return NULL;
+        g = (g+probe+1) & groupmask;
+    }
+    return NULL;
+}
+
+/* Take the first free slot in the probe sequence of the hash 'h' and return
+ * it as an entry to fill. The caller makes sure the key is not already in
+ * the table and that the table has room for it. */
+static dictEntry *_dictFlatInsert(dictht *ht, uint64_t h)
+{
+    unsigned long groupmask = (ht->size/DICT_GROUP_SIZE)-1;
+    unsigned long g = (h >> 7) & groupmask, probe, idx;
+    unsigned int mask;
+
+    for (probe = 0; ; probe++) {
+        mask = _dictGroupMatchFree(ht->ctrl+g*DICT_GROUP_SIZE);
+        if (mask) break;
+        g = (g+probe+1) & groupmask;
+    }
+    idx = g*DICT_GROUP_SIZE+_dictFirstBit(mask);
+    if (ht->ctrl[idx] == DICT_CTRL_EMPTY) ht->growthleft--;
+    ht->ctrl[idx] = DICT_CTRL_HASH(h);
+    if (probe > ht->maxprobe) ht->maxprobe = probe;
+    ht->used++;
+    return _dictFlatSlot(ht,idx);
+}
+
+/* Move 'n' groups of the old table to the new one, see dictRehash().
+ * The moved slots become tombstones: the keys still in the old table
+ * may have been pushed past them by the insertions. */
+static int _dictFlatRehash(dict *d, int n)
+{
+    dictht *old = &d->ht[0];
+
+    while(n--) {
+        unsigned long base, j;
+
+        if (old->used == 0) {
+            _dictFree(old->ctrl);
+            _dictFree(old->slots);
+            d->ht[0] = d->ht[1];
+            _dictReset(&d->ht[1]);
+            d->rehashidx = -1;
+            return 0;
+        }
+
+        base = d->rehashidx*DICT_GROUP_SIZE;
+        for (j = base; j < base+DICT_GROUP_SIZE; j++) {
+            dictEntry *he, *ne;
+
+            if (old->ctrl[j] & DICT_CTRL_FREE) continue;
+            he = _dictFlatSlot(old,j);
+            ne = _dictFlatInsert(&d->ht[1],dictHashKey(d, he->key));
+            ne->key = he->key;
+            ne->val = he->val;
+            old->ctrl[j] = DICT_CTRL_DELETED;
+            old->used--;
+        }
+        d->rehashidx++;
+    }
+    return 1;
+}
+
+/* Make sure there is room for one more element. Returns DICT_ERR if
+ * there is none and the table can't be grown right now. */
+static int _dictFlatExpandIfNeeded(dict *d)
+{
+    if (dictIsRehashing(d)) {
+        /* The new table takes at least 7/4 of the elements of the old one,
+         * while every insertion moves a group of 16 slots of the old table
+         * first, so the rehashing completes well before the new table is
+         * full. Only iterators, that stop the rehashing, can leave it
+         * without room for the elements still to move. Moving them now
+         * would break the iterators, so the insertion fails. */
+        if (d->ht[1].growthleft > d->ht[0].used) return DICT_OK;
+        if (d->iterators) return DICT_ERR;
+        /* The iterators are gone: finish the rehashing they delayed */
+        while(dictRehash(d,100));
+    }
+    if (d->ht[0].size == 0)
+        return dictExpand(d, DICT_HT_INITIAL_SIZE);
+    if (d->ht[0].growthleft == 0) {
+        /* Double the table if it's really full, otherwise it's full of
+         * tombstones and a rehash to the same size is enough. */
+        if (d->ht[0].used > (d->ht[0].size-d->ht[0].size/8)/2)
+            return dictExpand(d, d->ht[0].used*2);
+        return dictExpand(d, d->ht[0].size-d->ht[0].size/8);
+    }
+    return DICT_OK;
+}
+
+static dictEntry *_dictFlatAddOrFind(dict *d, void *key, int *existing)
+{
+    uint64_t h;
+    dictEntry *entry;
+    dictht *ht;
+    int room;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    room = _dictFlatExpandIfNeeded(d) == DICT_OK;
+    h = dictHashKey(d, key);
+    if ((entry = _dictFlatFind(d, &d->ht[0], key, h, NULL)) != NULL ||
+        (dictIsRehashing(d) &&
+         (entry = _dictFlatFind(d, &d->ht[1], key, h, NULL)) != NULL))
+    {
+        *existing = 1;
+        return entry;
+    }
+    *existing = 0;
+    if (!room) return NULL;
+
+    ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
+    entry = _dictFlatInsert(ht,h);
+    dictSetHashKey(d, entry, key);
+    entry->val = NULL;
+    return entry;
+}
+
+static int _dictFlatDelete(dict *d, const void *key, int nofree)
+{
+    uint64_t h;
+    unsigned long idx;
+    unsigned int table;
+
+    if (d->ht[0].size == 0)
+        return DICT_ERR;
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    h = dictHashKey(d, key);
+
+    for (table = 0; table <= 1; table++) {
+        dictht *ht = &d->ht[table];
+        dictEntry *he = _dictFlatFind(d, ht, key, h, &idx);
+
+        if (he) {
+            if (!nofree) {
+                dictFreeEntryKey(d, he);
+                dictFreeEntryVal(d, he);
+            }
+            /* No probe sequence went past a group with an empty slot */
+            if (_dictGroupMatch(ht->ctrl+(idx & ~(DICT_GROUP_SIZE-1)),
+                                DICT_CTRL_EMPTY))
+            {
+                ht->ctrl[idx] = DICT_CTRL_EMPTY;
+                ht->growthleft++;
+            } else {
+                ht->ctrl[idx] = DICT_CTRL_DELETED;
+            }
+            ht->used--;
+            return DICT_OK;
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+    return DICT_ERR; /* not found */
+}
+
+static void _dictFlatClear(dict *d, dictht *ht)
+{
+    unsigned long i;
+
+    for (i = 0; i < ht->size && ht->used > 0; i++) {
+        dictEntry *he;
+
+        if (ht->ctrl[i] & DICT_CTRL_FREE) continue;
+        he = _dictFlatSlot(ht,i);
+        dictFreeEntryKey(d, he);
+        dictFreeEntryVal(d, he);
+        ht->used--;
+    }
+    _dictFree(ht->ctrl);
+    _dictFree(ht->slots);
+    _dictReset(ht);
+}
+
+static dictEntry *_dictFlatNext(dictIterator *iter)
+{
+    while (1) {
+        dictht *ht = &iter->d->ht[iter->table];
+
+        iter->index++;
+        if (iter->index >= (long)ht->size) {
+            if (dictIsRehashing(iter->d) && iter->table == 0) {
+                iter->table++;
+                iter->index = -1;
+                continue;
+            }
+            return NULL;
+        }
+        if (!(ht->ctrl[iter->index] & DICT_CTRL_FREE))
+            return _dictFlatSlot(ht,iter->index);
+    }
+}
+
+static dictEntry *_dictFlatGetRandomKey(dict *d)
+{
+    dictht *ht;
+    unsigned long h;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    do {
+        if (dictIsRehashing(d)) {
+            /* The groups of the old table below rehashidx are empty */
+            unsigned long moved = d->rehashidx*DICT_GROUP_SIZE;
+
+            h = moved +
+                (_dictRandom() % (d->ht[0].size+d->ht[1].size-moved));
+            ht = &d->ht[0];
+            if (h >= d->ht[0].size) {
+                h -= d->ht[0].size;
+                ht = &d->ht[1];
+            }
+        } else {
+            ht = &d->ht[0];
+            h = _dictRandom() & ht->sizemask;
+        }
+    } while(ht->ctrl[h] & DICT_CTRL_FREE);
+    return _dictFlatSlot(ht,h);
+}
+
+static void _dictFlatPrintStatsHt(dictht *ht) {
+    unsigned long i, tombstones = 0;
+
+    if (ht->used == 0) {
+        printf("No stats available for empty dictionaries\n");
+        return;
     }
+    for (i = 0; i < ht->size; i++)
+        if (ht->ctrl[i] == DICT_CTRL_DELETED) tombstones++;
+    printf("Hash table stats (open addressing):\n");
+    printf(" table size: %lu\n", ht->size);
+    printf(" number of elements: %lu\n", ht->used);
+    printf(" load factor: %.02f\n", (float)ht->used/ht->size);
+    printf(" tombstones: %lu\n", tombstones);
+    printf(" max probe length: %lu groups\n", ht->maxprobe+1);
 }
 
 /* ----------------------- StringCopy Hash Table Type ------------------------*/
 
-static unsigned int _dictStringCopyHTHashFunction(const void *key)
+static uint64_t _dictStringCopyHTHashFunction(const void *key)
 {
     return dictGenHashFunction(key, strlen(key));
 }
@@ -521,7 +1302,9 @@ dictType dictTypeHeapStringCopyKey = {
     NULL,                               /* val dup */
     _dictStringCopyHTKeyCompare,          /* key compare */
     _dictStringCopyHTKeyDestructor,       /* key destructor */
-    NULL                                /* val destructor */
+    NULL,                               /* val destructor */
+    NULL,                               /* key embed size */
+    NULL                                /* key embed */
 };
 
 /* This is like StringCopy but does not auto-duplicate the key.
@@ -532,7 +1315,9 @@ dictType dictTypeHeapStrings = {
     NULL,                               /* val dup */
     _dictStringCopyHTKeyCompare,          /* key compare */
     _dictStringCopyHTKeyDestructor,       /* key destructor */
-    NULL                                /* val destructor */
+    NULL,                               /* val destructor */
+    NULL,                               /* key embed size */
+    NULL                                /* key embed */
 };
 
 /* This is like StringCopy but also automatically handle dynamic
@@ -544,4 +1329,6 @@ dictType dictTypeHeapStringCopyKeyValue = {
     _dictStringCopyHTKeyCompare,          /* key compare */
     _dictStringCopyHTKeyDestructor,       /* key destructor */
     _dictStringKeyValCopyHTValDestructor, /* val destructor */
+    NULL,                               /* key embed size */
+    NULL                                /* key embed */
 };
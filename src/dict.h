@@ -7,12 +7,19 @@
 #ifndef __DICT_H
 #define __DICT_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define DICT_OK 0
 #define DICT_ERR 1
 
 /* Unused arguments generate annoying warnings... */
 #define DICT_NOTUSED(V) ((void) V)
 
+/* Entries of open addressing dicts (see dictCreateFlat()) live inside the
+ * table itself and only have the key and val fields: 'next' must never be
+ * accessed, and the entry is only valid until the next operation on the
+ * dict (any lookup may perform a rehash step). */
 typedef struct dictEntry {
     void *key;
     void *val;
@@ -20,32 +27,59 @@ typedef struct dictEntry {
 } dictEntry;
 
 typedef struct dictType {
-    unsigned int (*hashFunction)(const void *key);
+    uint64_t (*hashFunction)(const void *key);
     void *(*keyDup)(void *privdata, const void *key);
     void *(*valDup)(void *privdata, const void *obj);
     int (*keyCompare)(void *privdata, const void *key1, const void *key2);
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
+    /* Optional: keys for which keyEmbedSize() is not zero are copied by
+     * keyEmbed() inside the allocation of the entry of chained tables,
+     * saving an allocation and a cache miss. keyEmbed() returns the key
+     * to store, that is hashed and compared like the ones not embedded,
+     * and the key it is given is released as if the entry was deleted. */
+    size_t (*keyEmbedSize)(const void *key);
+    void *(*keyEmbed)(void *buf, const void *key);
 } dictType;
 
-typedef struct dict {
+/* This is our hash table structure. Every dictionary has two of these, as
+ * we implement incremental rehashing, from the old to the new table.
+ * Chained tables use 'table', open addressing ones 'ctrl' and 'slots'. */
+typedef struct dictht {
     dictEntry **table;
+    unsigned char *ctrl;     /* control byte of every slot */
+    char *slots;             /* key/val pairs */
+    unsigned long size;
+    unsigned long sizemask;
+    unsigned long used;
+    unsigned long growthleft; /* slots that can be filled before growing */
+    unsigned long maxprobe;   /* longest probe sequence of an insertion */
+} dictht;
+
+typedef struct dict {
     dictType *type;
-    unsigned int size;
-    unsigned int sizemask;
-    unsigned int used;
     void *privdata;
+    dictht ht[2];
+    long rehashidx; /* rehashing not in progress if rehashidx == -1 */
+    int iterators; /* number of iterators currently running */
+    int flat; /* open addressing table, see dictCreateFlat() */
 } dict;
 
 typedef struct dictIterator {
-    dict *ht;
-    int index;
+    dict *d;
+    int table;
+    long index;
     dictEntry *entry, *nextEntry;
 } dictIterator;
 
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     16
 
+/* Algorithms of dictGenHashFunction(), see dictSetHashAlgorithm() */
+#define DICT_HASH_WYHASH 0
+#define DICT_HASH_SIPHASH 1
+#define DICT_HASH_SEED_LEN 16
+
 /* ------------------------------- Macros ------------------------------------*/
 #define dictFreeEntryVal(ht, entry) \
     if ((ht)->type->valDestructor) \
@@ -58,8 +92,12 @@ typedef struct dictIterator {
         entry->val = (_val_); \
 } while(0)
 
+#define dictIsEmbeddedKey(ht, key) \
+    (!(ht)->flat && (ht)->type->keyEmbedSize && \
+     (ht)->type->keyEmbedSize(key))
+
 #define dictFreeEntryKey(ht, entry) \
-    if ((ht)->type->keyDestructor) \
+    if ((ht)->type->keyDestructor && !dictIsEmbeddedKey(ht, (entry)->key)) \
         (ht)->type->keyDestructor((ht)->privdata, (entry)->key)
 
 #define dictSetHashKey(ht, entry, _key_) do { \
@@ -78,13 +116,17 @@ typedef struct dictIterator {
 
 #define dictGetEntryKey(he) ((he)->key)
 #define dictGetEntryVal(he) ((he)->val)
-#define dictGetHashTableSize(ht) ((ht)->size)
-#define dictGetHashTableUsed(ht) ((ht)->used)
+#define dictGetHashTableSize(d) ((d)->ht[0].size+(d)->ht[1].size)
+#define dictGetHashTableUsed(d) ((d)->ht[0].used+(d)->ht[1].used)
+#define dictSize(d) dictGetHashTableUsed(d)
+#define dictIsRehashing(d) ((d)->rehashidx != -1)
 
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
-int dictExpand(dict *ht, unsigned int size);
+dict *dictCreateFlat(dictType *type, void *privDataPtr);
+int dictExpand(dict *ht, unsigned long size);
 int dictAdd(dict *ht, void *key, void *val);
+dictEntry *dictAddOrFind(dict *ht, void *key, int *existing);
 int dictReplace(dict *ht, void *key, void *val);
 int dictDelete(dict *ht, const void *key);
 int dictDeleteNoFree(dict *ht, const void *key);
@@ -96,7 +138,12 @@ dictEntry *dictNext(dictIterator *iter);
 void dictReleaseIterator(dictIterator *iter);
 dictEntry *dictGetRandomKey(dict *ht);
 void dictPrintStats(dict *ht);
-unsigned int dictGenHashFunction(const unsigned char *buf, int len);
+int dictRehash(dict *d, int n);
+int dictRehashMilliseconds(dict *d, int ms);
+void dictSetHashFunctionSeed(const uint8_t *seed);
+void dictSetHashAlgorithm(int algorithm);
+uint64_t dictGenHashFunction(const void *buf, size_t len);
+uint64_t dictGenCaseHashFunction(const unsigned char *buf, size_t len);
 
 /* Hash table types */
 extern dictType dictTypeHeapStringCopyKey;
@@ -0,0 +1,180 @@
+/* Threaded network I/O.
+ *
+ * When "iothreads" is greater than one, readQueryFromClient() and
+ * addReply() don't touch the sockets but just queue the clients in
+ * server.clients_pending_read / server.clients_pending_write. Before
+ * entering the event loop again beforeSleep() splits these clients among
+ * the I/O threads (the main thread serves its own share too) that read and
+ * parse the query buffers, or flush the reply lists. The main thread waits
+ * for all of them to finish and only then executes the parsed commands, so
+ * server.dict and everything else is still only accessed by one thread. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "redis.h"
+#include "iothreads.h"
+
+#define IO_THREADS_OP_READ 0
+#define IO_THREADS_OP_WRITE 1
+
+typedef struct ioThread {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;                /* Set by the main thread, cleared when done */
+    redisClient **clients;      /* Clients assigned to this thread */
+    int numclients;
+    int size;
+} ioThread;
+
+static ioThread iothreads[REDIS_IOTHREADS_MAX];
+static int iothreadsOp;
+
+static void ioThreadServeClients(ioThread *t) {
+    int j;
+
+    for (j = 0; j < t->numclients; j++) {
+        redisClient *c = t->clients[j];
+
+        if (iothreadsOp == IO_THREADS_OP_READ) {
+            if (readClientSocket(c) == REDIS_OK && parseClientQuery(c) == 1)
+                c->flags |= REDIS_PENDING_COMMAND;
+        } else {
+            writeToClient(c);
+        }
+    }
+}
+
+static void *ioThreadMain(void *arg) {
+    ioThread *t = arg;
+
+    while(1) {
+        pthread_mutex_lock(&t->lock);
+        while(!t->pending) pthread_cond_wait(&t->cond,&t->lock);
+        pthread_mutex_unlock(&t->lock);
+
+        ioThreadServeClients(t);
+
+        pthread_mutex_lock(&t->lock);
+        t->pending = 0;
+        pthread_cond_signal(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+    }
+    return NULL;
+}
+
+static void ioThreadAddClient(ioThread *t, redisClient *c) {
+    if (t->numclients == t->size) {
+        t->size = t->size ? t->size*2 : 16;
+        t->clients = realloc(t->clients,sizeof(redisClient*)*t->size);
+        if (!t->clients) oom("ioThreadAddClient");
+    }
+    t->clients[t->numclients++] = c;
+}
+
+/* Split the clients among the I/O threads and wait for all of them to be
+ * served. With a single client there is nothing to parallelize, so the
+ * main thread does the work without waking up anybody. */
+static void ioThreadsServe(list *clients, int op) {
+    int j, nthreads, n = 0;
+    listNode *ln;
+
+    nthreads = listLength(clients) > 1 ? server.iothreads : 1;
+    for (ln = listFirst(clients); ln; ln = ln->next)
+        ioThreadAddClient(iothreads+(n++ % nthreads),listNodeValue(ln));
+
+    iothreadsOp = op;
+    for (j = 1; j < nthreads; j++) {
+        ioThread *t = iothreads+j;
+
+        if (t->numclients == 0) continue;
+        pthread_mutex_lock(&t->lock);
+        t->pending = 1;
+        pthread_cond_signal(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+    }
+    ioThreadServeClients(iothreads);
+    for (j = 1; j < nthreads; j++) {
+        ioThread *t = iothreads+j;
+
+        pthread_mutex_lock(&t->lock);
+        while(t->pending) pthread_cond_wait(&t->cond,&t->lock);
+        pthread_mutex_unlock(&t->lock);
+    }
+    for (j = 0; j < nthreads; j++) iothreads[j].numclients = 0;
+}
+
+void initThreadedIO(void) {
+    int j;
+
+    for (j = 1; j < server.iothreads; j++) {
+        ioThread *t = iothreads+j;
+
+        pthread_mutex_init(&t->lock,NULL);
+        pthread_cond_init(&t->cond,NULL);
+        if (pthread_create(&t->tid,NULL,ioThreadMain,t) != 0) {
+            redisLog(REDIS_WARNING,"Fatal: can't create I/O thread: %s",
+                strerror(errno));
+            exit(1);
+        }
+    }
+    if (server.iothreads > 1)
+        redisLog(REDIS_NOTICE,"%d I/O threads started", server.iothreads);
+}
+
+void handleClientsWithPendingReads(void) {
+    listNode *ln;
+
+    if (listLength(server.clients_pending_read) == 0) return;
+    ioThreadsServe(server.clients_pending_read,IO_THREADS_OP_READ);
+
+    /* Back to the main thread only: drop the clients that disconnected and
+     * execute the commands the threads parsed. */
+    while((ln = listFirst(server.clients_pending_read)) != NULL) {
+        redisClient *c = listNodeValue(ln);
+
+        listDelNode(server.clients_pending_read,ln);
+        c->flags &= ~REDIS_PENDING_READ;
+        if (c->flags & REDIS_CLOSE_ASAP) {
+            redisLog(REDIS_DEBUG, "Error reading from client");
+            freeClient(c);
+            continue;
+        }
+        /* The socket stays readable after EOF */
+        if (c->flags & REDIS_CLOSE_AFTER_REPLY && !server.edgetriggered)
+            aeDeleteFileEvent(server.el,c->fd,AE_READABLE);
+        /* Already used its budget in this iteration */
+        if (c->flags & REDIS_PENDING_INPUT) continue;
+        processInputBuffer(c);
+    }
+}
+
+void handleClientsWithPendingWrites(void) {
+    listNode *ln;
+
+    if (listLength(server.clients_pending_write) == 0) return;
+    ioThreadsServe(server.clients_pending_write,IO_THREADS_OP_WRITE);
+
+    while((ln = listFirst(server.clients_pending_write)) != NULL) {
+        redisClient *c = listNodeValue(ln);
+
+        listDelNode(server.clients_pending_write,ln);
+        c->flags &= ~REDIS_PENDING_WRITE;
+        if (c->flags & REDIS_CLOSE_ASAP) {
+            redisLog(REDIS_DEBUG, "Error writing to client");
+            freeClient(c);
+            continue;
+        }
+        trimClientReply(c);
+        if (c->bufpos == 0 && listLength(c->reply) == 0) {
+            c->sentlen = 0;
+            freeClientIfDone(c);
+        } else if (!server.edgetriggered && aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
+                   sendReplyToClient, c) == AE_ERR) {
+            freeClient(c);
+        }
+    }
+}
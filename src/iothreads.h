@@ -0,0 +1,8 @@
+#ifndef IOTHREADS_H
+#define IOTHREADS_H
+
+void initThreadedIO(void);
+void handleClientsWithPendingReads(void);
+void handleClientsWithPendingWrites(void);
+
+#endif
@@ -0,0 +1,212 @@
+/* Asynchronous logging.
+ *
+ * Once initAsyncLog() is called redisLog() no longer writes to the log
+ * file itself: the message is formatted straight into a slot of a bounded
+ * ring buffer, and a background thread appends the queued records to the
+ * log file. Producers (the main thread and the I/O threads) reserve slots
+ * with a compare and swap on the head index and publish them with a per
+ * slot sequence number, so they never take a lock nor wait for the disk.
+ * When the ring is full the message is dropped and counted: slowing down
+ * the server because the log can't keep up is not an option.
+ *
+ * Before initAsyncLog(), and in the child process after fork(), messages
+ * are written synchronously as usual. flushAsyncLog() is registered with
+ * atexit() so that the messages logged right before exit() are not lost. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "redis.h"
+#include "log.h"
+
+#define LOG_RING_MASK (REDIS_LOG_RING_SIZE-1)
+
+typedef struct logRecord {
+    unsigned long seq;          /* Equal to the write position when free,
+                                 * to the position+1 once published */
+    int level;
+    char msg[REDIS_LOG_MSG_LEN];
+} logRecord;
+
+static logRecord ring[REDIS_LOG_RING_SIZE];
+static unsigned long ringHead;  /* Next position to write, producers */
+static unsigned long ringTail;  /* Next position to read, consumer only */
+static unsigned long dropped;   /* Messages lost because the ring was full */
+static int async;               /* The logger thread is running */
+static int sleeping;            /* The logger thread waits for messages */
+static pthread_t logtid;
+static pthread_mutex_t consumerlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sleeplock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sleepcond = PTHREAD_COND_INITIALIZER;
+
+static void resetRing(void) {
+    unsigned long j;
+
+    for (j = 0; j < REDIS_LOG_RING_SIZE; j++) ring[j].seq = j;
+    ringHead = ringTail = 0;
+    dropped = 0;
+}
+
+static FILE *openLogFile(void) {
+    return (server.logfile == NULL) ? stdout : fopen(server.logfile,"a");
+}
+
+static void closeLogFile(FILE *fp) {
+    fflush(fp);
+    if (server.logfile) fclose(fp);
+}
+
+static void writeLogLine(FILE *fp, int level, const char *msg) {
+    char *c = ".-*";
+
+    fprintf(fp,"%c %s\n",c[level],msg);
+}
+
+/* Write the published records to the log file. The caller must hold
+ * consumerlock. The file is opened once per batch rather than kept open
+ * so that the log can still be rotated just by moving it away. */
+static void drainRing(void) {
+    unsigned long lost;
+    FILE *fp = NULL;
+
+    while(1) {
+        logRecord *r = ring+(ringTail & LOG_RING_MASK);
+
+        if (__atomic_load_n(&r->seq,__ATOMIC_ACQUIRE) != ringTail+1) break;
+        if (!fp && (fp = openLogFile()) == NULL) return;
+        writeLogLine(fp,r->level,r->msg);
+        __atomic_store_n(&r->seq,ringTail+REDIS_LOG_RING_SIZE,
+            __ATOMIC_RELEASE);
+        ringTail++;
+    }
+    lost = __atomic_exchange_n(&dropped,0,__ATOMIC_RELAXED);
+    if (lost) {
+        char msg[64];
+
+        if (!fp && (fp = openLogFile()) == NULL) return;
+        snprintf(msg,sizeof(msg),"%lu log messages dropped",lost);
+        writeLogLine(fp,REDIS_WARNING,msg);
+    }
+    if (fp) closeLogFile(fp);
+}
+
+static int ringIsEmpty(void) {
+    logRecord *r = ring+(ringTail & LOG_RING_MASK);
+
+    return __atomic_load_n(&r->seq,__ATOMIC_SEQ_CST) != ringTail+1 &&
+           __atomic_load_n(&dropped,__ATOMIC_RELAXED) == 0;
+}
+
+static void *logThreadMain(void *arg) {
+    REDIS_NOTUSED(arg);
+
+    while(1) {
+        pthread_mutex_lock(&consumerlock);
+        drainRing();
+        pthread_mutex_unlock(&consumerlock);
+
+        /* Producers only signal us when 'sleeping' is set, and they check
+         * it after publishing: setting it before looking at the ring once
+         * more guarantees no message is left behind. */
+        pthread_mutex_lock(&sleeplock);
+        __atomic_store_n(&sleeping,1,__ATOMIC_SEQ_CST);
+        if (ringIsEmpty()) pthread_cond_wait(&sleepcond,&sleeplock);
+        __atomic_store_n(&sleeping,0,__ATOMIC_RELAXED);
+        pthread_mutex_unlock(&sleeplock);
+    }
+    return NULL;
+}
+
+/* Reserve a slot, format the message in place and publish it. Returns
+ * REDIS_ERR if the ring is full. */
+static int logPush(int level, const char *fmt, va_list ap) {
+    unsigned long pos = __atomic_load_n(&ringHead,__ATOMIC_RELAXED);
+    logRecord *r;
+
+    while(1) {
+        long diff;
+
+        r = ring+(pos & LOG_RING_MASK);
+        diff = (long)(__atomic_load_n(&r->seq,__ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ringHead,&pos,pos+1,1,
+                __ATOMIC_RELAXED,__ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            return REDIS_ERR;
+        } else {
+            pos = __atomic_load_n(&ringHead,__ATOMIC_RELAXED);
+        }
+    }
+    r->level = level;
+    vsnprintf(r->msg,sizeof(r->msg),fmt,ap);
+    __atomic_store_n(&r->seq,pos+1,__ATOMIC_SEQ_CST);
+    return REDIS_OK;
+}
+
+/* Called via the redisLog() macro, that already filtered the level */
+void _redisLog(int level, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap,fmt);
+    if (__atomic_load_n(&async,__ATOMIC_RELAXED)) {
+        if (logPush(level,fmt,ap) == REDIS_ERR) {
+            __atomic_fetch_add(&dropped,1,__ATOMIC_RELAXED);
+        } else if (__atomic_load_n(&sleeping,__ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&sleeplock);
+            pthread_cond_signal(&sleepcond);
+            pthread_mutex_unlock(&sleeplock);
+        }
+    } else {
+        char msg[REDIS_LOG_MSG_LEN];
+        FILE *fp = openLogFile();
+
+        if (fp) {
+            vsnprintf(msg,sizeof(msg),fmt,ap);
+            writeLogLine(fp,level,msg);
+            closeLogFile(fp);
+        }
+    }
+    va_end(ap);
+}
+
+/* Write synchronously whatever is still queued */
+void flushAsyncLog(void) {
+    if (!__atomic_load_n(&async,__ATOMIC_RELAXED)) return;
+    pthread_mutex_lock(&consumerlock);
+    drainRing();
+    pthread_mutex_unlock(&consumerlock);
+}
+
+/* The logger thread does not exist in a forked child: the child starts
+ * with an empty ring (the parent will write the queued records) and logs
+ * synchronously. Holding consumerlock across fork() makes sure the ring
+ * is not copied while the logger thread is in the middle of a batch. */
+static void logAtForkPrepare(void) {
+    pthread_mutex_lock(&consumerlock);
+}
+
+static void logAtForkParent(void) {
+    pthread_mutex_unlock(&consumerlock);
+}
+
+static void logAtForkChild(void) {
+    async = 0;
+    resetRing();
+    pthread_mutex_unlock(&consumerlock);
+}
+
+void initAsyncLog(void) {
+    resetRing();
+    if (pthread_create(&logtid,NULL,logThreadMain,NULL) != 0) {
+        redisLog(REDIS_WARNING,"Can't create the logger thread: %s, "
+            "logging synchronously",strerror(errno));
+        return;
+    }
+    pthread_atfork(logAtForkPrepare,logAtForkParent,logAtForkChild);
+    atexit(flushAsyncLog);
+    __atomic_store_n(&async,1,__ATOMIC_RELEASE);
+}
@@ -0,0 +1,7 @@
+#ifndef LOG_H
+#define LOG_H
+
+void initAsyncLog(void);
+void flushAsyncLog(void);
+
+#endif
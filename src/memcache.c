@@ -0,0 +1,352 @@
+/* Memcached binary protocol frontend.
+ *
+ * Clients connecting to the "memcachedport" speak the memcached binary
+ * protocol instead of the Redis one. They are normal clients flagged
+ * REDIS_MEMCACHE: the query buffer is read as usual, then mcParseRequest()
+ * splits every request in argv[0] (the 24 bytes header followed by the
+ * extras), argv[1] (the key) and argv[2] (the value).
+ *
+ * mcProcessRequest() rewrites argv as the equivalent Redis command and
+ * calls its proc, with c->capture set so that the Redis reply is collected
+ * instead of being sent. The reply is then translated to the memcached
+ * response. Quiet requests only get a response on errors (GETQ and GETKQ
+ * don't get one on misses), so clients can send a batch of them followed
+ * by a NOOP, and the responses are written together.
+ *
+ * The 32 bit flags of SET are kept in the mcflags field of the value
+ * object, that is otherwise padding, and are not saved on disk. Keys
+ * never expire: a request with a nonzero expiration is rejected with
+ * "Not supported", and CAS is ignored. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include "redis.h"
+#include "command.h"
+#include "memcache.h"
+
+#define MC_HEADER_LEN 24
+#define MC_REQUEST_MAGIC 0x80
+#define MC_RESPONSE_MAGIC 0x81
+
+/* Opcodes */
+#define MC_CMD_GET 0x00
+#define MC_CMD_SET 0x01
+#define MC_CMD_DELETE 0x04
+#define MC_CMD_INCREMENT 0x05
+#define MC_CMD_GETQ 0x09
+#define MC_CMD_NOOP 0x0a
+#define MC_CMD_GETK 0x0c
+#define MC_CMD_GETKQ 0x0d
+#define MC_CMD_SETQ 0x11
+#define MC_CMD_DELETEQ 0x14
+#define MC_CMD_INCREMENTQ 0x15
+
+/* Response status */
+#define MC_STATUS_OK 0x0000
+#define MC_STATUS_KEY_NOT_FOUND 0x0001
+#define MC_STATUS_INVALID_ARGS 0x0004
+#define MC_STATUS_NON_NUMERIC 0x0006
+#define MC_STATUS_UNKNOWN_COMMAND 0x0081
+#define MC_STATUS_NOT_SUPPORTED 0x0083
+#define MC_STATUS_INTERNAL_ERROR 0x0084
+
+/* The request being processed, decoded from the header in argv[0] */
+typedef struct mcRequest {
+    unsigned char opcode;
+    uint32_t opaque;
+    unsigned char *extras;
+    int extlen;
+    int quiet;
+} mcRequest;
+
+static uint32_t mcGet32(const unsigned char *p) {
+    return ((uint32_t)p[0]<<24)|((uint32_t)p[1]<<16)|((uint32_t)p[2]<<8)|p[3];
+}
+
+static uint64_t mcGet64(const unsigned char *p) {
+    return ((uint64_t)mcGet32(p)<<32)|mcGet32(p+4);
+}
+
+static void mcPut32(unsigned char *p, uint32_t v) {
+    p[0] = v>>24; p[1] = v>>16; p[2] = v>>8; p[3] = v;
+}
+
+/* Split the next request in argv as described at the top of the file.
+ * Same return values as parseClientQuery(). */
+int mcParseRequest(redisClient *c) {
+    unsigned char *h = (unsigned char*)c->querybuf+c->qb_pos;
+    size_t avail = sdslen(c->querybuf)-c->qb_pos;
+    uint32_t bodylen;
+    int keylen, extlen;
+
+    if (avail < MC_HEADER_LEN) return 0;
+    if (h[0] != MC_REQUEST_MAGIC) return -1;
+    keylen = (h[2]<<8)|h[3];
+    extlen = h[4];
+    bodylen = mcGet32(h+8);
+    if (bodylen > REDIS_MAX_BULK_LEN || (uint32_t)keylen+extlen > bodylen)
+        return -1;
+    if (avail < MC_HEADER_LEN+bodylen) return 0;
+
+    clientArgvMakeRoom(c,3);
+    c->argv[0] = sdsnewlen(h,MC_HEADER_LEN+extlen);
+    c->argv[1] = sdsnewlen(h+MC_HEADER_LEN+extlen,keylen);
+    c->argv[2] = sdsnewlen(h+MC_HEADER_LEN+extlen+keylen,
+                           bodylen-extlen-keylen);
+    c->argc = 3;
+    c->qb_pos += MC_HEADER_LEN+bodylen;
+    return 1;
+}
+
+/* Queue a response for the request 'req'. */
+static void mcAddResponse(redisClient *c, mcRequest *req, int status,
+        void *extras, int extlen, void *key, int keylen,
+        void *value, size_t vallen)
+{
+    unsigned char h[MC_HEADER_LEN];
+    sds buf;
+
+    memset(h,0,sizeof(h));
+    h[0] = MC_RESPONSE_MAGIC;
+    h[1] = req->opcode;
+    h[2] = keylen>>8;
+    h[3] = keylen;
+    h[4] = extlen;
+    h[6] = status>>8;
+    h[7] = status;
+    mcPut32(h+8,extlen+keylen+vallen);
+    mcPut32(h+12,req->opaque);
+    /* CAS is left to zero, it is not supported */
+    buf = sdsnewlen(h,sizeof(h));
+    buf = sdscatlen(buf,extras,extlen);
+    buf = sdscatlen(buf,key,keylen);
+    buf = sdscatlen(buf,value,vallen);
+    addReplySds(c,buf);
+}
+
+static void mcAddError(redisClient *c, mcRequest *req, int status,
+                       char *msg)
+{
+    mcAddResponse(c,req,status,NULL,0,NULL,0,msg,strlen(msg));
+}
+
+/* Rewrite argv as the Redis command 'name' with 'argc' arguments, the key
+ * being argv[1] and the value, if needed, argv[2]. The reply of the
+ * command is collected in c->capture until mcEndCall() returns it. */
+static void mcBeginCall(redisClient *c, char *name, int argc) {
+    int j;
+
+    for (j = argc; j < c->argc; j++) sdsfree(c->argv[j]);
+    c->argv[0] = sdsnew(name);
+    c->argc = argc;
+    c->capture = sdsempty();
+}
+
+static sds mcEndCall(redisClient *c) {
+    sds reply = c->capture;
+
+    c->capture = NULL;
+    return reply;
+}
+
+static sds mcCall(redisClient *c, redisCommandProc *proc, char *name,
+                  int argc)
+{
+    mcBeginCall(c,name,argc);
+    proc(c);
+    return mcEndCall(c);
+}
+
+/* Redis errors are "-ERR ..." lines, or bulk replies with a negative
+ * length followed by the message. */
+static void mcAddRedisError(redisClient *c, mcRequest *req, sds reply) {
+    char *msg = reply+1;
+
+    if (isdigit((unsigned char)*msg) && strchr(msg,'\n'))
+        msg = strchr(msg,'\n')+1;
+    mcAddResponse(c,req,MC_STATUS_INTERNAL_ERROR,NULL,0,NULL,0,
+        msg,strcspn(msg,"\r\n"));
+}
+
+static void mcGet(redisClient *c, mcRequest *req, int withkey) {
+    sds key = sdsdup(c->argv[1]);
+    sds reply = mcCall(c,getCommand,"get",2);
+    unsigned char flags[4];
+    dictEntry *de;
+    char *data;
+
+    if (!strcmp(reply,"nil\r\n")) {
+        if (!req->quiet) {
+            mcAddResponse(c,req,MC_STATUS_KEY_NOT_FOUND,NULL,0,
+                key,withkey ? sdslen(key) : 0,"Not found",9);
+        }
+    } else if (reply[0] == '-' || (data = strchr(reply,'\n')) == NULL) {
+        mcAddRedisError(c,req,reply);
+    } else {
+        /* "<len>\r\n<data>\r\n" */
+        de = dictFind(c->dict,key);
+        mcPut32(flags,((robj*)dictGetEntryVal(de))->mcflags);
+        mcAddResponse(c,req,MC_STATUS_OK,flags,sizeof(flags),
+            key,withkey ? sdslen(key) : 0,data+1,strtol(reply,NULL,10));
+    }
+    sdsfree(key);
+    sdsfree(reply);
+}
+
+/* Send the response of commands replying +OK on success. */
+static void mcAddStatusReply(redisClient *c, mcRequest *req, sds reply) {
+    if (reply[0] != '+')
+        mcAddRedisError(c,req,reply);
+    else if (!req->quiet)
+        mcAddResponse(c,req,MC_STATUS_OK,NULL,0,NULL,0,NULL,0);
+    sdsfree(reply);
+}
+
+/* Keys can't expire, so the requests asking for it are refused. */
+static int mcCheckExpiration(redisClient *c, mcRequest *req, uint32_t exp) {
+    if (exp == 0) return 1;
+    mcAddError(c,req,MC_STATUS_NOT_SUPPORTED,"Expiration not supported");
+    return 0;
+}
+
+/* Set the memcached flags of the value just stored at 'key'. */
+static void mcSetFlags(redisClient *c, sds key, uint32_t flags) {
+    dictEntry *de = dictFind(c->dict,key);
+
+    if (de) ((robj*)dictGetEntryVal(de))->mcflags = flags;
+}
+
+/* The extras are the 32 bit flags and the 32 bit expiration. */
+static void mcSet(redisClient *c, mcRequest *req) {
+    sds key, reply;
+
+    if (req->extlen != 8 || sdslen(c->argv[1]) == 0) {
+        mcAddError(c,req,MC_STATUS_INVALID_ARGS,"Invalid arguments");
+        return;
+    }
+    if (!mcCheckExpiration(c,req,mcGet32(req->extras+4))) return;
+    key = sdsdup(c->argv[1]);
+    reply = mcCall(c,setCommand,"set",3);
+    if (reply[0] == '+') mcSetFlags(c,key,mcGet32(req->extras));
+    mcAddStatusReply(c,req,reply);
+    sdsfree(key);
+}
+
+static void mcDelete(redisClient *c, mcRequest *req) {
+    if (req->extlen != 0) {
+        mcAddError(c,req,MC_STATUS_INVALID_ARGS,"Invalid arguments");
+        return;
+    }
+    /* DEL replies +OK anyway, so misses must be checked before */
+    if (dictFind(c->dict,c->argv[1]) == NULL) {
+        mcAddError(c,req,MC_STATUS_KEY_NOT_FOUND,"Not found");
+        return;
+    }
+    mcAddStatusReply(c,req,mcCall(c,delCommand,"del",2));
+}
+
+/* The extras are the 64 bit delta, the 64 bit initial value and the 32 bit
+ * expiration: a missing key is created with the initial value, unless the
+ * expiration is 0xffffffff. The response is the new 64 bit value. The
+ * flags of an existing value are preserved. */
+static void mcIncrement(redisClient *c, mcRequest *req) {
+    unsigned char value[8];
+    uint32_t exp, flags = 0;
+    dictEntry *de;
+    long long ll;
+    sds reply;
+
+    if (req->extlen != 20) {
+        mcAddError(c,req,MC_STATUS_INVALID_ARGS,"Invalid arguments");
+        return;
+    }
+    exp = mcGet32(req->extras+16);
+    if (exp != 0xffffffff && !mcCheckExpiration(c,req,exp)) return;
+    de = dictFind(c->dict,c->argv[1]);
+    if (de == NULL) {
+        if (exp == 0xffffffff) {
+            mcAddError(c,req,MC_STATUS_KEY_NOT_FOUND,"Not found");
+            return;
+        }
+        sdsfree(c->argv[2]);
+        c->argv[2] = sdsfromlonglong((long long)mcGet64(req->extras+8));
+        reply = mcCall(c,setCommand,"set",3);
+        if (reply[0] != '+') {
+            mcAddRedisError(c,req,reply);
+            sdsfree(reply);
+            return;
+        }
+        ll = mcGet64(req->extras+8);
+    } else {
+        robj *o = dictGetEntryVal(de);
+        sds key;
+
+        if (o->type != REDIS_STRING ||
+            !string2ll(o->ptr,sdslen(o->ptr),&ll))
+        {
+            mcAddError(c,req,MC_STATUS_NON_NUMERIC,
+                "Non-numeric server-side value for incr or decr");
+            return;
+        }
+        flags = o->mcflags;
+        key = sdsdup(c->argv[1]);
+        mcBeginCall(c,"incr",2);
+        incrDecrCommand(c,(long long)mcGet64(req->extras));
+        reply = mcEndCall(c);
+        if (reply[0] == '-') {
+            mcAddRedisError(c,req,reply);
+            sdsfree(reply);
+            sdsfree(key);
+            return;
+        }
+        ll = strtoll(reply,NULL,10);
+        mcSetFlags(c,key,flags);
+        sdsfree(key);
+    }
+    sdsfree(reply);
+    if (!req->quiet) {
+        mcPut32(value,(uint64_t)ll>>32);
+        mcPut32(value+4,(uint64_t)ll);
+        mcAddResponse(c,req,MC_STATUS_OK,NULL,0,NULL,0,value,sizeof(value));
+    }
+}
+
+/* Execute the request parsed by mcParseRequest(). Like processCommand()
+ * returns 1 as the client is always still valid. */
+int mcProcessRequest(redisClient *c) {
+    sds header = c->argv[0];
+    unsigned char *h = (unsigned char*)header;
+    mcRequest req;
+
+    c->argv[0] = NULL; /* Replaced by the command name */
+    req.opcode = h[1];
+    req.opaque = mcGet32(h+12);
+    req.extras = h+MC_HEADER_LEN;
+    req.extlen = h[4];
+    req.quiet = 0;
+
+    switch(req.opcode) {
+    case MC_CMD_GETQ: req.quiet = 1; /* fall through */
+    case MC_CMD_GET: mcGet(c,&req,0); break;
+    case MC_CMD_GETKQ: req.quiet = 1; /* fall through */
+    case MC_CMD_GETK: mcGet(c,&req,1); break;
+    case MC_CMD_SETQ: req.quiet = 1; /* fall through */
+    case MC_CMD_SET: mcSet(c,&req); break;
+    case MC_CMD_DELETEQ: req.quiet = 1; /* fall through */
+    case MC_CMD_DELETE: mcDelete(c,&req); break;
+    case MC_CMD_INCREMENTQ: req.quiet = 1; /* fall through */
+    case MC_CMD_INCREMENT: mcIncrement(c,&req); break;
+    case MC_CMD_NOOP:
+        mcAddResponse(c,&req,MC_STATUS_OK,NULL,0,NULL,0,NULL,0);
+        break;
+    default:
+        mcAddError(c,&req,MC_STATUS_UNKNOWN_COMMAND,"Unknown command");
+        break;
+    }
+    sdsfree(header);
+    resetClient(c);
+    return 1;
+}
@@ -0,0 +1,9 @@
+#ifndef MEMCACHE_H
+#define MEMCACHE_H
+
+#include "redis.h"
+
+int mcParseRequest(redisClient *c);
+int mcProcessRequest(redisClient *c);
+
+#endif
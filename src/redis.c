@@ -14,12 +14,19 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 
 #include "redis.h"
 #include "command.h"
 #include "db.h"
+#include "iothreads.h"
+#include "memcache.h"
+#include "log.h"
 
 /* Global vars */
 struct redisServer server; /* server global state */
@@ -54,7 +61,7 @@ struct redisCommand cmdTable[] = {
     {"lastsave",lastsaveCommand,1,REDIS_CMD_INLINE},
     /* lpop, rpop, lindex, llen */
     /* dirty, lastsave, info */
-    {"",NULL,0,0}
+    {NULL,NULL,0,0}
 };
 
 /*============================ Utility functions ============================ */
@@ -182,25 +189,85 @@ int stringmatchlen(const char *pattern, int patternLen,
     return 0;
 }
 
-void redisLog(int level, const char *fmt, ...)
-{
-    va_list ap;
-    FILE *fp;
-
-    fp = (server.logfile == NULL) ? stdout : fopen(server.logfile,"a");
-    if (!fp) return;
-
-    va_start(ap, fmt);
-    if (level >= server.verbosity) {
-        char *c = ".-*";
-        fprintf(fp,"%c ",c[level]);
-        vfprintf(fp, fmt, ap);
-        fprintf(fp,"\n");
-        fflush(fp);
+/* Convert the 'slen' bytes at 's' into a long long. Returns 1 on success,
+ * 0 if the string is not a plain base 10 integer (no spaces, no leading
+ * '+' or zeros) or doesn't fit a long long. */
+int string2ll(const char *s, size_t slen, long long *value) {
+    const char *p = s, *end = s+slen;
+    unsigned long long v;
+    int negative = 0;
+
+    if (slen == 0) return 0;
+    if (slen == 1 && p[0] == '0') {
+        *value = 0;
+        return 1;
+    }
+    if (p[0] == '-') {
+        negative = 1;
+        if (++p == end) return 0;
     }
-    va_end(ap);
+    if (p[0] < '1' || p[0] > '9') return 0;
+    v = *p++ - '0';
+    while(p < end && p[0] >= '0' && p[0] <= '9') {
+        if (v > ULLONG_MAX/10) return 0;
+        v *= 10;
+        if (v > ULLONG_MAX-(p[0]-'0')) return 0;
+        v += *p++ - '0';
+    }
+    if (p < end) return 0;
+    if (negative) {
+        if (v > ((unsigned long long)(-(LLONG_MIN+1)))+1) return 0;
+        *value = -v;
+    } else {
+        if (v > LLONG_MAX) return 0;
+        *value = v;
+    }
+    return 1;
+}
 
-    if (server.logfile) fclose(fp);
+/* Convert a string representing an amount of memory into the number of
+ * bytes, so for instance memtoll("1gb") will return 1073741824 that is
+ * (1024*1024*1024). On parsing error, if *err is not NULL, it's set to 1,
+ * otherwise it's set to 0. */
+long long memtoll(const char *p, int *err) {
+    const char *u;
+    char buf[128];
+    long mul; /* unit multiplier */
+    long long val;
+    unsigned int digits;
+
+    if (err) *err = 0;
+    /* Search the first non digit character. */
+    u = p;
+    if (*u == '-') u++;
+    while(*u && isdigit(*u)) u++;
+    if (*u == '\0' || !strcasecmp(u,"b")) {
+        mul = 1;
+    } else if (!strcasecmp(u,"k")) {
+        mul = 1000;
+    } else if (!strcasecmp(u,"kb")) {
+        mul = 1024;
+    } else if (!strcasecmp(u,"m")) {
+        mul = 1000*1000;
+    } else if (!strcasecmp(u,"mb")) {
+        mul = 1024*1024;
+    } else if (!strcasecmp(u,"g")) {
+        mul = 1000L*1000*1000;
+    } else if (!strcasecmp(u,"gb")) {
+        mul = 1024L*1024*1024;
+    } else {
+        if (err) *err = 1;
+        return 0;
+    }
+    digits = u-p;
+    if (digits == 0 || digits >= sizeof(buf)) {
+        if (err) *err = 1;
+        return 0;
+    }
+    memcpy(buf,p,digits);
+    buf[digits] = '\0';
+    val = strtoll(buf,NULL,10);
+    return val*mul;
 }
 
 /*====================== Hash table type implementation  ==================== */
@@ -209,7 +276,7 @@ void redisLog(int level, const char *fmt, ...)
  * keys and radis objects as values (objects can hold SDS strings,
  * lists, sets). */
 
-unsigned int sdsDictHashFunction(const void *key) {
+uint64_t sdsDictHashFunction(const void *key) {
     return dictGenHashFunction(key, sdslen((sds)key));
 }
 
@@ -239,6 +306,18 @@ void sdsDictValDestructor(void *privdata, void *val)
     decrRefCount(val);
 }
 
+/* Short keys are copied inside the dict entry, as an sds string so that
+ * they can be read like the others, see dictType */
+size_t sdsDictKeyEmbedSize(const void *key) {
+    size_t len = sdslen((sds)key);
+
+    return (len <= REDIS_EMBED_KEY_MAX) ? sdsembedsize(len) : 0;
+}
+
+void *sdsDictKeyEmbed(void *buf, const void *key) {
+    return sdsembed(buf, key, sdslen((sds)key));
+}
+
 dictType sdsDictType = {
     sdsDictHashFunction,       /* hash function */
     NULL,                      /* key dup */
@@ -246,6 +325,37 @@ dictType sdsDictType = {
     sdsDictKeyCompare,         /* key compare */
     sdsDictKeyDestructor,      /* key destructor */
     sdsDictValDestructor,      /* val destructor */
+    sdsDictKeyEmbedSize,       /* key embed size */
+    sdsDictKeyEmbed            /* key embed */
+};
+
+/* The command table is looked up with the command name exactly as the
+ * client sent it, so hashing and comparison ignore the case. */
+uint64_t sdsCaseDictHashFunction(const void *key) {
+    return dictGenCaseHashFunction(key, sdslen((sds)key));
+}
+
+int sdsCaseDictKeyCompare(void *privdata, const void *key1,
+        const void *key2)
+{
+    int l1,l2;
+    DICT_NOTUSED(privdata);
+
+    l1 = sdslen((sds)key1);
+    l2 = sdslen((sds)key2);
+    if (l1 != l2) return 0;
+    return strncasecmp(key1, key2, l1) == 0;
+}
+
+dictType commandTableDictType = {
+    sdsCaseDictHashFunction,   /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    sdsCaseDictKeyCompare,     /* key compare */
+    sdsDictKeyDestructor,      /* key destructor */
+    NULL,                      /* val destructor */
+    NULL,                      /* key embed size */
+    NULL                       /* key embed */
 };
 
 /* ========================= Random utility functions ======================= */
@@ -262,27 +372,72 @@ void oom(const char *msg) {
     abort();
 }
 
+/* Refresh the cached clocks. Reading the time is not free, so this is done
+ * once per event loop iteration and everything else, including the I/O
+ * threads and the commands, uses server.unixtime and server.mstime. The
+ * monotonic one, the same clock the event loop timers use, is the right
+ * choice to measure elapsed time. */
+void updateCachedTime(void) {
+    struct timespec ts;
+
+    server.unixtime = time(NULL);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    server.mstime = ((long long)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
 /* ====================== Redis server networking stuff ===================== */
+
+/* Idle clients are tracked with a timing wheel: server.timeouts has a
+ * bucket for every second (modulo REDIS_TIMEOUT_WHEEL_SIZE), and a client
+ * is linked in the bucket of the second of its last interaction when it is
+ * created or when its bucket is checked. The bucket is not updated at
+ * every interaction, so reading and writing clients only costs storing
+ * lastinteraction, the I/O threads can do it as well. */
+static void addClientTimeout(redisClient *c) {
+    int slot = c->lastinteraction % REDIS_TIMEOUT_WHEEL_SIZE;
+
+    if (!listAddNodeTail(server.timeouts[slot],c)) oom("listAddNodeTail");
+    c->timeoutnode = listLast(server.timeouts[slot]);
+    c->timeoutslot = slot;
+}
+
+static void delClientTimeout(redisClient *c) {
+    listDelNode(server.timeouts[c->timeoutslot],c->timeoutnode);
+}
+
+/* Check the buckets of the seconds that became due since the last call.
+ * Every client found there was either idle for more than maxidletime, or
+ * had some interaction in the meantime and is just moved to the right
+ * bucket, or is due in a later turn of the wheel and stays there. */
 void closeTimedoutClients(void) {
-    redisClient *c;
-    listIter *li;
-    listNode *ln;
-    time_t now = time(NULL);
-
-    li = listGetIterator(server.clients,AL_START_HEAD);
-    if (!li) return;
-    while ((ln = listNextElement(li)) != NULL) {
-        c = listNodeValue(ln);
-        if (now - c->lastinteraction > server.maxidletime) {
-            redisLog(REDIS_DEBUG,"Closing idle client");
-            freeClient(c);
+    time_t now = server.unixtime;
+    time_t due = now - server.maxidletime - 1;
+    int n = 0;
+
+    while(server.timeoutcheck < due && n++ < REDIS_TIMEOUT_WHEEL_SIZE) {
+        int slot = ++server.timeoutcheck % REDIS_TIMEOUT_WHEEL_SIZE;
+        listNode *ln = listFirst(server.timeouts[slot]), *next;
+
+        while(ln) {
+            redisClient *c = listNodeValue(ln);
+
+            next = ln->next;
+            if (now - c->lastinteraction > server.maxidletime) {
+                redisLog(REDIS_DEBUG,"Closing idle client");
+                freeClient(c);
+            } else if (c->lastinteraction % REDIS_TIMEOUT_WHEEL_SIZE != slot) {
+                delClientTimeout(c);
+                addClientTimeout(c);
+            }
+            ln = next;
         }
     }
-    listReleaseIterator(li);
+    server.timeoutcheck = due;
 }
 
 int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
-    int j, size, used, loops = server.cronloops++;
+    int j, loops = server.cronloops++;
+    unsigned long size, used;
     REDIS_NOTUSED(eventLoop);
     REDIS_NOTUSED(id);
     REDIS_NOTUSED(clientData);
@@ -293,23 +448,27 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         size = dictGetHashTableSize(server.dict[j]);
         used = dictGetHashTableUsed(server.dict[j]);
         if (!(loops % 5) && used > 0) {
-            redisLog(REDIS_DEBUG,"DB %d: %d keys in %d slots HT.",j,used,size);
+            redisLog(REDIS_DEBUG,"DB %d: %lu keys in %lu slots HT.",j,used,size);
             // dictPrintStats(server.dict);
         }
         if (size && used && size > REDIS_HT_MINSLOTS &&
             (used*100/size < REDIS_HT_MINFILL)) {
-            redisLog(REDIS_NOTICE,"The hash table %d is too sparse, resize it...",j);
-            dictResize(server.dict[j]);
-            redisLog(REDIS_NOTICE,"Hash table %d resized.",j);
+            if (dictResize(server.dict[j]) == DICT_OK)
+                redisLog(REDIS_NOTICE,"The hash table %d is too sparse, "
+                    "resizing it",j);
         }
+        /* Tables are rehashed a bucket at a time as they are accessed,
+         * help the ones that are idle. Not while saving in background
+         * however, to avoid copy-on-write of the memory we touch. */
+        if (dictIsRehashing(server.dict[j]) && !server.bgsaveinprogress)
+            dictRehashMilliseconds(server.dict[j],REDIS_HT_REHASH_MS);
     }
 
     /* Show information about connected clients */
     if (!(loops % 5)) redisLog(REDIS_DEBUG,"%d clients connected",listLength(server.clients));
 
     /* Close connections of timedout clients */
-    if (!(loops % 10))
-        closeTimedoutClients();
+    closeTimedoutClients();
 
     /* Check if a background saving in progress terminated */
     if (server.bgsaveinprogress) {
@@ -320,7 +479,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                 redisLog(REDIS_NOTICE,
                     "Background saving terminated with success");
                 server.dirty = 0;
-                server.lastsave = time(NULL);
+                server.lastsave = server.unixtime;
             } else {
                 redisLog(REDIS_WARNING,
                     "Background saving error");
@@ -330,7 +489,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     } else {
         /* If there is not a background saving in progress check if
          * we have to save now */
-         time_t now = time(NULL);
+         time_t now = server.unixtime;
          for (j = 0; j < server.saveparamslen; j++) {
             struct saveparam *sp = server.saveparams+j;
 
@@ -346,7 +505,30 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     return 1000;
 }
 
+/* Called every time Redis returns from waiting for events, before they
+ * are processed. */
+void afterSleep(struct aeEventLoop *eventLoop) {
+    REDIS_NOTUSED(eventLoop);
+
+    updateCachedTime();
+}
+
+/* This function gets called every time Redis is entering the
+ * main loop of the event driven library, that is, before to sleep
+ * for ready file descriptors. */
+void beforeSleep(struct aeEventLoop *eventLoop) {
+    REDIS_NOTUSED(eventLoop);
+
+    handleClientsWithPendingInput();
+    handleClientsWithPendingReads();
+    handleClientsWithPendingWrites();
+    /* Don't sleep in the poll while some client has commands waiting */
+    aeSetDontWait(server.el,listLength(server.clients_pending_input) != 0);
+}
+
 void createSharedObjects(void) {
+    int j;
+
     shared.crlf = createObject(REDIS_STRING,sdsnew("\r\n"));
     shared.ok = createObject(REDIS_STRING,sdsnew("+OK\r\n"));
     shared.err = createObject(REDIS_STRING,sdsnew("-ERR\r\n"));
@@ -355,6 +537,11 @@ void createSharedObjects(void) {
     shared.zero = createObject(REDIS_STRING,sdsnew("0\r\n"));
     shared.one = createObject(REDIS_STRING,sdsnew("1\r\n"));
     shared.pong = createObject(REDIS_STRING,sdsnew("+PONG\r\n"));
+    for (j = 0; j < REDIS_SHARED_BULKHDR_LEN; j++) {
+        sds hdr = sdscatlen(sdsfromlonglong(j),"\r\n",2);
+
+        shared.bulkhdr[j] = createObject(REDIS_STRING,hdr);
+    }
 }
 
 void appendServerSaveParams(time_t seconds, int changes) {
@@ -372,12 +559,34 @@ void ResetServerSaveParams() {
 }
 
 void initServerConfig() {
+    int j;
+
     server.dbnum = REDIS_DEFAULT_DBNUM;
     server.port = REDIS_SERVERPORT;
     server.verbosity = REDIS_DEBUG;
     server.maxidletime = REDIS_MAXIDLETIME;
     server.saveparams = NULL;
+    server.hashalgorithm = DICT_HASH_WYHASH;
+    server.flatdbs = NULL;
+    server.flatdbslen = 0;
     server.logfile = NULL; /* NULL = log on standard output */
+    server.iothreads = 1;
+    server.backlog = REDIS_TCP_BACKLOG;
+    server.unixsocket = NULL;
+    server.unixsocketperm = 0;
+    server.sofd = -1;
+    server.mcport = 0;
+    server.mcfd = -1;
+    server.maxclients = 0;
+    server.edgetriggered = 0;
+    server.maxcommandsperevent = REDIS_MAX_COMMANDS_PER_EVENT;
+    server.maxbytesperevent = REDIS_MAX_BYTES_PER_EVENT;
+    server.obufpause = REDIS_OUTPUT_PAUSE_BYTES;
+    for (j = 0; j < REDIS_CLIENT_CLASSES; j++) {
+        server.obuflimits[j].hard = 1024*1024*256;
+        server.obuflimits[j].soft = 1024*1024*64;
+        server.obuflimits[j].softseconds = 60;
+    }
     ResetServerSaveParams();
 
     appendServerSaveParams(60*60,1);  /* save after 1 hour and 1 change */
@@ -385,34 +594,152 @@ void initServerConfig() {
     appendServerSaveParams(60,10000); /* save after 1 minute and 10000 changes */
 }
 
+/* The kernel silently caps the listen() backlog to somaxconn: warn if the
+ * configured one will not be honoured. */
+static void checkTcpBacklog(void) {
+    FILE *fp = fopen("/proc/sys/net/core/somaxconn","r");
+    char buf[64];
+
+    if (!fp) return;
+    if (fgets(buf,sizeof(buf),fp) != NULL) {
+        int somaxconn = atoi(buf);
+
+        if (somaxconn > 0 && somaxconn < server.backlog)
+            redisLog(REDIS_WARNING,"The TCP backlog setting of %d cannot be "
+                "enforced because /proc/sys/net/core/somaxconn is set to %d",
+                server.backlog, somaxconn);
+    }
+    fclose(fp);
+}
+
+/* Seed the hash function of the dicts with random bytes, so that clients
+ * can't know in advance which keys collide. */
+static void initHashFunctionSeed(void) {
+    uint8_t seed[DICT_HASH_SEED_LEN];
+    FILE *fp = fopen("/dev/urandom","r");
+
+    if (fp == NULL || fread(seed,sizeof(seed),1,fp) != 1) {
+        struct timeval tv;
+        unsigned int j;
+
+        redisLog(REDIS_WARNING,"Can't read /dev/urandom, seeding the hash "
+            "function with the time and pid");
+        gettimeofday(&tv,NULL);
+        srandom(tv.tv_sec ^ tv.tv_usec ^ getpid());
+        for (j = 0; j < sizeof(seed); j++) seed[j] = random();
+    }
+    if (fp) fclose(fp);
+    dictSetHashFunctionSeed(seed);
+    dictSetHashAlgorithm(server.hashalgorithm);
+}
+
+/* Return true if the database 'id' was configured with flatdatabases */
+static int isFlatDatabase(int id) {
+    int j;
+
+    for (j = 0; j < server.flatdbslen; j++)
+        if (server.flatdbs[j] == -1 || server.flatdbs[j] == id) return 1;
+    return 0;
+}
+
+/* Fill server.commands with the entries of cmdTable, keyed by name */
+static void populateCommandTable(void) {
+    int j;
+
+    server.commands = dictCreate(&commandTableDictType,NULL);
+    if (!server.commands) oom("dictCreate");
+    for (j = 0; cmdTable[j].name != NULL; j++) {
+        sds name = sdsnew(cmdTable[j].name);
+
+        if (!name || dictAdd(server.commands,name,&cmdTable[j]) != DICT_OK)
+            oom("populateCommandTable");
+    }
+}
+
 void initServer() {
     int j;
 
     signal(SIGHUP, SIG_IGN);
     signal(SIGPIPE, SIG_IGN);
+    /* Only now "databases" is known whatever the order of the directives */
+    for (j = 0; j < server.flatdbslen; j++) {
+        if (server.flatdbs[j] >= server.dbnum) {
+            redisLog(REDIS_WARNING,"Invalid database %d in flatdatabases, "
+                "there are %d databases", server.flatdbs[j], server.dbnum);
+            exit(1);
+        }
+    }
+    initHashFunctionSeed();
 
     server.clients = listCreate();
+    server.clients_pending_read = listCreate();
+    server.clients_pending_write = listCreate();
+    server.clients_pending_input = listCreate();
     server.objfreelist = listCreate();
+    for (j = 0; j < REDIS_TIMEOUT_WHEEL_SIZE; j++) {
+        if ((server.timeouts[j] = listCreate()) == NULL)
+            oom("server initialization");
+    }
+    updateCachedTime();
+    server.timeoutcheck = server.unixtime - server.maxidletime - 1;
     createSharedObjects();
-    server.el = aeCreateEventLoop();
+    populateCommandTable();
+    server.el = aeCreateEventLoop(server.maxclients ?
+        server.maxclients+REDIS_EVENTLOOP_FDSET_INCR : REDIS_EVENTLOOP_SETSIZE);
     server.dict = malloc(sizeof(dict*)*server.dbnum);
-    if (!server.dict || !server.clients || !server.el || !server.objfreelist)
+    if (!server.dict || !server.clients || !server.el || !server.objfreelist ||
+        !server.clients_pending_read || !server.clients_pending_write ||
+        !server.clients_pending_input)
         oom("server initialization"); /* Fatal OOM */
-    server.fd = anetTcpServer(server.neterr, server.port, NULL);
-    if (server.fd == -1) {
+    if (server.edgetriggered && strcmp(aeApiName(),"epoll")) {
+        redisLog(REDIS_WARNING,"Edge triggered mode is not supported by the "
+            "%s event loop, disabling it", aeApiName());
+        server.edgetriggered = 0;
+    }
+    checkTcpBacklog();
+    server.fd = anetTcpServer(server.neterr, server.port, NULL,
+        server.backlog);
+    /* acceptHandler() drains the listen queue until accept() would block */
+    if (server.fd == -1 || anetNonBlock(server.neterr,server.fd) == ANET_ERR) {
         redisLog(REDIS_WARNING, "Opening TCP port: %s", server.neterr);
         exit(1);
     }
+    if (server.mcport) {
+        server.mcfd = anetTcpServer(server.neterr, server.mcport, NULL,
+            server.backlog);
+        if (server.mcfd == -1 ||
+            anetNonBlock(server.neterr,server.mcfd) == ANET_ERR) {
+            redisLog(REDIS_WARNING, "Opening memcached port: %s",
+                server.neterr);
+            exit(1);
+        }
+    }
+    if (server.unixsocket) {
+        server.sofd = anetUnixServer(server.neterr, server.unixsocket,
+            server.unixsocketperm, server.backlog);
+        if (server.sofd == -1 ||
+            anetNonBlock(server.neterr,server.sofd) == ANET_ERR) {
+            redisLog(REDIS_WARNING, "Opening unix socket: %s", server.neterr);
+            exit(1);
+        }
+    }
     for (j = 0; j < server.dbnum; j++) {
-        server.dict[j] = dictCreate(&sdsDictType,NULL);
+        if (isFlatDatabase(j))
+            server.dict[j] = dictCreateFlat(&sdsDictType,NULL);
+        else
+            server.dict[j] = dictCreate(&sdsDictType,NULL);
         if (!server.dict[j])
             oom("server initialization"); /* Fatal OOM */
     }
     server.cronloops = 0;
     server.bgsaveinprogress = 0;
-    server.lastsave = time(NULL);
+    server.lastsave = server.unixtime;
     server.dirty = 0;
     aeCreateTimeEvent(server.el, 1000, serverCron, NULL, NULL);
+    aeSetBeforeSleepProc(server.el, beforeSleep);
+    aeSetAfterSleepProc(server.el, afterSleep);
+    initThreadedIO();
+    initAsyncLog();
 }
 
 /* I agree, this is a very rudimental way to load a configuration...
@@ -492,6 +819,110 @@ void loadServerConfig(char *filename) {
             if (server.dbnum < 1) {
                 err = "Invalid number of databases"; goto loaderr;
             }
+        } else if (!strcmp(argv[0],"flatdatabases") && argc >= 2) {
+            int j, id;
+
+            for (j = 1; j < argc; j++) {
+                if (!strcasecmp(argv[j],"all")) {
+                    id = -1;
+                } else {
+                    /* Checked against "databases" by initServer() */
+                    id = atoi(argv[j]);
+                    if (id < 0) {
+                        err = "Invalid database in flatdatabases"; goto loaderr;
+                    }
+                }
+                server.flatdbs = realloc(server.flatdbs,
+                    sizeof(int)*(server.flatdbslen+1));
+                if (server.flatdbs == NULL) oom("flatdatabases");
+                server.flatdbs[server.flatdbslen++] = id;
+            }
+        } else if (!strcmp(argv[0],"iothreads") && argc == 2) {
+            server.iothreads = atoi(argv[1]);
+            if (server.iothreads < 1 ||
+                server.iothreads > REDIS_IOTHREADS_MAX) {
+                err = "Invalid number of I/O threads"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"maxclients") && argc == 2) {
+            server.maxclients = atoi(argv[1]);
+            if (server.maxclients < 0) {
+                err = "Invalid max clients limit"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"maxcommandsperevent") && argc == 2) {
+            server.maxcommandsperevent = atoi(argv[1]);
+            if (server.maxcommandsperevent < 0) {
+                err = "Invalid max commands per event"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"maxbytesperevent") && argc == 2) {
+            server.maxbytesperevent = strtoll(argv[1],NULL,10);
+            if (server.maxbytesperevent < 0) {
+                err = "Invalid max bytes per event"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"outputbufferlimit") && argc == 5) {
+            int class, soft_seconds, memerr = 0;
+            unsigned long long hard, soft;
+
+            if (!strcasecmp(argv[1],"normal")) {
+                class = REDIS_CLIENT_NORMAL;
+            } else if (!strcasecmp(argv[1],"memcache")) {
+                class = REDIS_CLIENT_MEMCACHE;
+            } else {
+                err = "Invalid client class specified in outputbufferlimit";
+                goto loaderr;
+            }
+            hard = memtoll(argv[2],&memerr);
+            if (!memerr) soft = memtoll(argv[3],&memerr);
+            soft_seconds = atoi(argv[4]);
+            if (memerr || (long long)hard < 0 || (long long)soft < 0 ||
+                soft_seconds < 0)
+            {
+                err = "Invalid outputbufferlimit argument"; goto loaderr;
+            }
+            server.obuflimits[class].hard = hard;
+            server.obuflimits[class].soft = soft;
+            server.obuflimits[class].softseconds = soft_seconds;
+        } else if (!strcmp(argv[0],"outputbufferpause") && argc == 2) {
+            int memerr;
+
+            server.obufpause = memtoll(argv[1],&memerr);
+            if (memerr || (long long)server.obufpause < 0) {
+                err = "Invalid outputbufferpause value"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"backlog") && argc == 2) {
+            server.backlog = atoi(argv[1]);
+            if (server.backlog < 1) {
+                err = "Invalid backlog value"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"memcachedport") && argc == 2) {
+            server.mcport = atoi(argv[1]);
+            if (server.mcport < 0 || server.mcport > 65535) {
+                err = "Invalid memcached port"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"unixsocket") && argc == 2) {
+            server.unixsocket = strdup(argv[1]);
+            if (!server.unixsocket) oom("strdup");
+        } else if (!strcmp(argv[0],"unixsocketperm") && argc == 2) {
+            char *eptr;
+
+            errno = 0;
+            server.unixsocketperm = (mode_t)strtol(argv[1], &eptr, 8);
+            if (errno || *eptr != '\0' || server.unixsocketperm > 0777) {
+                err = "Invalid socket file permissions"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"hashfunction") && argc == 2) {
+            if (!strcmp(argv[1],"wyhash"))
+                server.hashalgorithm = DICT_HASH_WYHASH;
+            else if (!strcmp(argv[1],"siphash"))
+                server.hashalgorithm = DICT_HASH_SIPHASH;
+            else {
+                err = "argument must be 'wyhash' or 'siphash'"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"edgetriggered") && argc == 2) {
+            if (!strcmp(argv[1],"yes")) server.edgetriggered = 1;
+            else if (!strcmp(argv[1],"no")) server.edgetriggered = 0;
+            else {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else {
             err = "Bad directive or wrong number of arguments"; goto loaderr;
         }
@@ -517,75 +948,163 @@ void freeClientArgv(redisClient *c) {
 }
 
 void freeClient(redisClient *c) {
-    listNode *ln;
-
     aeDeleteFileEvent(server.el,c->fd,AE_READABLE);
     aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
     sdsfree(c->querybuf);
     listRelease(c->reply);
     freeClientArgv(c);
+    free(c->argv);
     close(c->fd);
-    ln = listSearchKey(server.clients,c);
-    assert(ln != NULL);
-    listDelNode(server.clients,ln);
+    listDelNode(server.clients,c->node);
+    delClientTimeout(c);
+    if (c->flags & REDIS_PENDING_READ)
+        listDelNode(server.clients_pending_read,c->readnode);
+    if (c->flags & REDIS_PENDING_WRITE)
+        listDelNode(server.clients_pending_write,c->writenode);
+    if (c->flags & REDIS_PENDING_INPUT)
+        listDelNode(server.clients_pending_input,c->inputnode);
     free(c);
 }
 
-void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
-    redisClient *c = privdata;
-    int nwritten = 0, totwritten = 0, objlen;
-    robj *o;
-    REDIS_NOTUSED(el);
-    REDIS_NOTUSED(mask);
+/* Write to the socket as much of the reply as possible: first the inline
+ * buffer c->buf, then the reply list. The objects are sent with writev() in
+ * batches of up to REDIS_IOV_MAX, the first one starting at c->sentlen.
+ * Objects that were fully sent are not released here but just counted in
+ * c->sentobjs, since dropping the reference may touch the free list of
+ * objects: this is up to trimClientReply(), called later by the main thread.
+ * This way writeToClient() is safe to call from the I/O threads.
+ *
+ * On write errors the client is flagged REDIS_CLOSE_ASAP and REDIS_ERR is
+ * returned: the caller is in charge of freeing it. */
+int writeToClient(redisClient *c) {
+    struct iovec iov[REDIS_IOV_MAX];
+    ssize_t nwritten = 0, totwritten = 0;
+    listNode *ln = listFirst(c->reply);
+
+    while(c->bufpos || ln) {
+        listNode *next;
+        size_t iovlen = 0, offset = c->sentlen;
+        int iovcnt = 0;
+
+        if (c->bufpos) {
+            iov[0].iov_base = c->buf+c->sentlen;
+            iov[0].iov_len = c->bufpos-c->sentlen;
+            iovlen = iov[0].iov_len;
+            iovcnt = 1;
+            offset = 0;
+        }
+        for (next = ln; next && iovcnt < REDIS_IOV_MAX; next = next->next) {
+            robj *o = listNodeValue(next);
+
+            iov[iovcnt].iov_base = (char*)o->ptr+offset;
+            iov[iovcnt].iov_len = sdslen(o->ptr)-offset;
+            iovlen += iov[iovcnt].iov_len;
+            iovcnt++;
+            offset = 0;
+        }
+        /* Nothing to write if the batch is made of empty objects only */
+        nwritten = iovlen ? writev(c->fd, iov, iovcnt) : 0;
+        if (nwritten < 0 || (nwritten == 0 && iovlen)) break;
+        totwritten += nwritten;
+        /* A short write means the socket buffer is full */
+        if ((size_t)nwritten < iovlen) next = NULL;
 
-    while(listLength(c->reply)) {
-        o = listNodeValue(listFirst(c->reply));
-        objlen = sdslen(o->ptr);
+        /* Advance over the buffer, then over the objects we fully sent */
+        if (c->bufpos) {
+            size_t left = c->bufpos-c->sentlen;
 
-        if (objlen == 0) {
-            listDelNode(c->reply,listFirst(c->reply));
-            continue;
+            if ((size_t)nwritten < left) {
+                c->sentlen += nwritten;
+                break;
+            }
+            nwritten -= left;
+            c->bufpos = 0;
+            c->sentlen = 0;
         }
+        while(ln) {
+            robj *o = listNodeValue(ln);
+            size_t left = sdslen(o->ptr)-c->sentlen;
 
-        nwritten = write(fd, o->ptr+c->sentlen, objlen - c->sentlen);
-        if (nwritten <= 0) break;
-        c->sentlen += nwritten;
-        totwritten += nwritten;
-        /* If we fully sent the object on head go to the next one */
-        if (c->sentlen == objlen) {
-            listDelNode(c->reply,listFirst(c->reply));
+            if ((size_t)nwritten < left) {
+                c->sentlen += nwritten;
+                break;
+            }
+            nwritten -= left;
             c->sentlen = 0;
+            c->sentobjs++;
+            ln = ln->next;
         }
+        if (next == NULL) break;
     }
-    if (nwritten == -1) {
-        if (errno == EAGAIN) {
-            nwritten = 0;
-        } else {
-            redisLog(REDIS_DEBUG,
-                "Error writing to client: %s", strerror(errno));
-            freeClient(c);
-            return;
+    if (totwritten > 0) c->lastinteraction = server.unixtime;
+    if (nwritten == -1 && errno != EAGAIN) {
+        c->flags |= REDIS_CLOSE_ASAP;
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* Release the reply objects writeToClient() completely sent. A client
+ * whose reads were paused by addReply() is resumed once its reply gets
+ * under the threshold again: what is left in its query buffer is
+ * processed in beforeSleep(), like for clients out of their budget. */
+void trimClientReply(redisClient *c) {
+    while(c->sentobjs) {
+        robj *o = listNodeValue(listFirst(c->reply));
+
+        c->reply_bytes -= sdslen(o->ptr);
+        listDelNode(c->reply,listFirst(c->reply));
+        c->sentobjs--;
+    }
+    if (c->flags & REDIS_READ_PAUSED && c->reply_bytes < server.obufpause) {
+        int edge = server.edgetriggered ? AE_EDGE : 0;
+
+        c->flags &= ~REDIS_READ_PAUSED;
+        if (aeCreateFileEvent(server.el, c->fd, AE_READABLE|edge,
+            readQueryFromClient, c) == AE_ERR)
+            c->flags |= REDIS_CLOSE_ASAP; /* Freed by processInputBuffer() */
+        if (!(c->flags & REDIS_PENDING_INPUT)) {
+            c->flags |= REDIS_PENDING_INPUT;
+            if (!listAddNodeTail(server.clients_pending_input,c))
+                oom("listAddNodeTail");
+            c->inputnode = listLast(server.clients_pending_input);
         }
     }
-    if (totwritten > 0) c->lastinteraction = time(NULL);
-    if (listLength(c->reply) == 0) {
+}
+
+void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+    redisClient *c = privdata;
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(fd);
+    REDIS_NOTUSED(mask);
+
+    if (writeToClient(c) == REDIS_ERR) {
+        redisLog(REDIS_DEBUG,
+            "Error writing to client: %s", strerror(errno));
+        freeClient(c);
+        return;
+    }
+    trimClientReply(c);
+    if (c->bufpos == 0 && listLength(c->reply) == 0) {
         c->sentlen = 0;
-        aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
+        if (freeClientIfDone(c)) return;
+        /* In edge triggered mode the writable event stays registered */
+        if (!server.edgetriggered)
+            aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
     }
 }
 
-struct redisCommand *lookupCommand(char *name) {
-    int j = 0;
-    while(cmdTable[j].name != NULL) {
-        if (!strcmp(name,cmdTable[j].name)) return &cmdTable[j];
-        j++;
-    }
-    return NULL;
+struct redisCommand *lookupCommand(sds name) {
+    dictEntry *de = dictFind(server.commands,name);
+
+    return de ? dictGetEntryVal(de) : NULL;
 }
 
 /* resetClient prepare the client to process the next command */
 void resetClient(redisClient *c) {
     freeClientArgv(c);
+    c->reqtype = 0;
+    c->multibulklen = 0;
     c->bulklen = -1;
 }
 
@@ -601,16 +1120,17 @@ int processCommand(redisClient *c) {
     redisLog(REDIS_DEBUG, "processCommand");
     struct redisCommand *cmd;
 
-    sdstolower(c->argv[0]);
-    /* The QUIT command is handled as a special case. Normal command
-     * procs are unable to close the client connection safely */
-    if (!strcmp(c->argv[0],"quit")) {
-        freeClient(c);
-        return 0;
-    }
+    if (c->flags & REDIS_MEMCACHE) return mcProcessRequest(c);
+
     cmd = lookupCommand(c->argv[0]);
-    
     if (!cmd) {
+        /* The QUIT command is handled as a special case. Normal command
+         * procs are unable to close the client connection safely, so it
+         * is not in the command table. */
+        if (!strcasecmp(c->argv[0],"quit")) {
+            freeClient(c);
+            return 0;
+        }
         addReplySds(c,sdsnew("-ERR unknown command\r\n"));
         resetClient(c);
         return 1;
@@ -620,79 +1140,117 @@ int processCommand(redisClient *c) {
         addReplySds(c,sdsnew("-ERR wrong number of arguments\r\n"));
         resetClient(c);
         return 1;
-    } 
+    } else if (cmd->type == REDIS_CMD_BULK &&
+               c->reqtype == REDIS_REQ_INLINE && c->bulklen == -1) {
+        /* The last argument of the inline request is the length of the
+         * bulk data that follows: it is read by parseClientQuery(), and
+         * we'll be called again once it is available. */
+        long long bulklen;
+        sds lenarg = c->argv[c->argc-1];
+
+        if (!string2ll(lenarg,sdslen(lenarg),&bulklen) ||
+            bulklen < 0 || bulklen > REDIS_MAX_BULK_LEN)
+        {
+            addReplySds(c,sdsnew("-ERR invalid bulk write count\r\n"));
+            resetClient(c);
+            return 1;
+        }
+        sdsfree(lenarg);
+        c->argc--;
+        c->bulklen = bulklen+2; /* add two bytes for CR+LF */
+        return 1;
+    }
     /* Exec the command */
     cmd->proc(c);
+    resetClient(c);
     return 1;
 }
 
-void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
-    
-    redisLog(REDIS_DEBUG, "readQueryFromClient");
-    
-    redisClient *c = (redisClient*) privdata;
-    char buf[REDIS_QUERYBUF_LEN];
-    int nread;
-    REDIS_NOTUSED(el);
-    REDIS_NOTUSED(mask);
-
-    nread = read(fd, buf, REDIS_QUERYBUF_LEN);
-    if (nread == -1) {
-        if (errno == EAGAIN) {
-            nread = 0;
-        } else {
-            redisLog(REDIS_DEBUG, "Reading from client: %s",strerror(errno));
-            freeClient(c);
-            return;
+/* Append to the query buffer what is available on the client socket.
+ * On read errors the client is flagged REDIS_CLOSE_ASAP and REDIS_ERR is
+ * returned, it's up to the caller to free it. On EOF it is flagged
+ * REDIS_CLOSE_AFTER_REPLY instead: the commands it already sent are
+ * executed, and freeClientIfDone() releases it once they got their
+ * replies. Like writeToClient() this function is called by the I/O
+ * threads as well.
+ *
+ * In edge triggered mode we'll not be notified again for data that is
+ * already in the socket buffer, so the socket is drained until read()
+ * returns EAGAIN or EOF: a short read is not enough to stop, since a FIN
+ * queued behind the data raises no new edge and the half closed client
+ * would never be released. */
+int readClientSocket(redisClient *c) {
+    int nread, totread = 0;
+
+    /* Already got EOF, the socket may still be reported readable */
+    if (c->flags & REDIS_CLOSE_AFTER_REPLY) return REDIS_OK;
+    while(1) {
+        size_t qblen = sdslen(c->querybuf);
+
+        /* Read straight into the query buffer */
+        c->querybuf = sdsMakeRoomFor(c->querybuf, REDIS_QUERYBUF_LEN);
+        if (c->querybuf == NULL) oom("sdsMakeRoomFor");
+        nread = read(c->fd, c->querybuf+qblen, REDIS_QUERYBUF_LEN);
+        if (nread == -1) {
+            if (errno == EAGAIN) break;
+            c->flags |= REDIS_CLOSE_ASAP;
+            return REDIS_ERR;
+        } else if (nread == 0) {
+            c->flags |= REDIS_CLOSE_AFTER_REPLY;
+            break;
         }
-    } else if (nread == 0) {
-        redisLog(REDIS_DEBUG, "Client closed connection");
-        freeClient(c);
-        return;
-    }
-    if (nread) {
-        c->querybuf = sdscatlen(c->querybuf, buf, nread);
-        c->lastinteraction = time(NULL);
-    } else {
-        return;
+        sdsIncrLen(c->querybuf, nread);
+        totread += nread;
+        if (!server.edgetriggered) break;
     }
+    if (totread) c->lastinteraction = server.unixtime;
+    return REDIS_OK;
+}
+
+/* Make room for at least 'n' arguments in the client argv. */
+void clientArgvMakeRoom(redisClient *c, int n) {
+    sds *argv;
+    int argvlen = c->argvlen ? c->argvlen : REDIS_ARGV_MIN;
+
+    if (n <= c->argvlen) return;
+    while(argvlen < n) argvlen *= 2;
+    argv = realloc(c->argv,sizeof(sds)*argvlen);
+    if (!argv) oom("clientArgvMakeRoom");
+    c->argv = argv;
+    c->argvlen = argvlen;
+}
 
-again:
-     
+/* Parse an inline request: a line with the arguments separated by spaces.
+ * The arguments of REDIS_CMD_BULK commands are followed by the length of
+ * the last argument, that processCommand() sets in c->bulklen: the data is
+ * read here as well once it is in the buffer. */
+static int parseInlineQuery(redisClient *c) {
     if (c->bulklen == -1) {
         /* Read the first line of the query */
-        char *p = strchr(c->querybuf,'\n');
-        size_t querylen;
-        if (p) {
-            sds query, *argv;
+        while(1) {
+            char *query = c->querybuf+c->qb_pos;
+            size_t avail = sdslen(c->querybuf)-c->qb_pos;
+            char *p = memchr(query,'\n',avail);
+            size_t querylen;
+            sds *argv;
             int argc, j;
-            
-            query = c->querybuf;
-            c->querybuf = sdsempty();
-            querylen = 1+(p-(query));
-            if (sdslen(query) > querylen) {
-                /* leave data after the first line of the query in the buffer */
-                c->querybuf = sdscatlen(c->querybuf,query+querylen,sdslen(query)-querylen);
-            }
-            *p = '\0'; /* remove "\n" */
-            if (*(p-1) == '\r') *(p-1) = '\0'; /* and "\r" if any */
-            sdsupdatelen(query);
+
+            if (!p) return (avail >= REDIS_INLINE_MAX_SIZE) ? -1 : 0;
+            c->qb_pos += 1+(p-query);
+            querylen = p-query; /* remove "\n" */
+            if (querylen && query[querylen-1] == '\r') querylen--; /* and "\r" if any */
 
             /* Now we can split the query in arguments */
-            if (sdslen(query) == 0) {
-                /* Ignore empty query */
-                sdsfree(query);
-                return;
-            }
-            argv = sdssplitlen(query, sdslen(query), " ", 1, &argc);
-            sdsfree(query);
+            if (querylen == 0) continue; /* Ignore empty query */
+            argv = sdssplitlen(query, querylen, " ", 1, &argc);
             if (argv == NULL) oom("Splitting query in token");
             
             /**
              * 假如命令是：  echo hello
              * 那么处理的结果就是：c->argv[0] = "echo", c->argv[1] = "hello"
              **/
-            for (j = 0; j < argc && j < REDIS_MAX_ARGS; j++) {
+            clientArgvMakeRoom(c,argc);
+            for (j = 0; j < argc; j++) {
                 if (sdslen(argv[j])) {
                     c->argv[c->argc] = argv[j];
                     c->argc++;
@@ -701,33 +1259,251 @@ again:
                 }
             }
             free(argv); // 删除"\0"防止内存泄漏
-            /* Execute the command. If the client is still valid
-             * after processCommand() return and there is something
-             * on the query buffer try to process the next command. */
-            if (processCommand(c) && sdslen(c->querybuf)) goto again;
-            resetClient(c);
-            return;
-        } else if (sdslen(c->querybuf) >= 1024) {
-            redisLog(REDIS_DEBUG, "Client protocol error");
-            freeClient(c); 
-            return;
+            if (c->argc) return 1;
         }
     } else {
         /* Bulk read handling. Note that if we are at this point
            the client already sent a command terminated with a newline,
            we are reading the bulk data that is actually the last
            argument of the command. */
-        int qbl = sdslen(c->querybuf);
+        long qbl = sdslen(c->querybuf)-c->qb_pos;
 
         if (c->bulklen <= qbl) {
             /* Copy everything but the final CRLF as final argument */
-            c->argv[c->argc] = sdsnewlen(c->querybuf, c->bulklen-2);
+            clientArgvMakeRoom(c,c->argc+1);
+            c->argv[c->argc] = sdsnewlen(c->querybuf+c->qb_pos, c->bulklen-2);
             c->argc++;
-            c->querybuf = sdsrange(c->querybuf, c->bulklen, -1);
-            processCommand(c);
-            resetClient(c);
+            c->qb_pos += c->bulklen;
+            return 1;
+        }
+        return 0;
+    }
+}
+
+/* Parse the "<prefix><number>\r\n" line at c->qb_pos, as the "*<argc>" and
+ * "$<len>" headers of multi bulk requests. Returns 1 and advances qb_pos
+ * if the line was parsed, 0 if it's not complete yet, -1 if it is not
+ * valid or 'max' is exceeded. */
+static int parseMultibulkHeader(redisClient *c, char prefix, long long max,
+                                long long *value)
+{
+    char *line = c->querybuf+c->qb_pos;
+    size_t avail = sdslen(c->querybuf)-c->qb_pos;
+    char *cr = memchr(line,'\r',avail);
+
+    if (!cr) return (avail > REDIS_INLINE_MAX_SIZE) ? -1 : 0;
+    if (cr+1 == line+avail) return 0; /* The "\n" is not there yet */
+    if (line[0] != prefix || cr[1] != '\n' ||
+        !string2ll(line+1,cr-(line+1),value) || *value > max) return -1;
+    c->qb_pos += (cr-line)+2;
+    return 1;
+}
+
+/* Parse a multi bulk request: "*<argc>\r\n" followed by every argument as
+ * "$<len>\r\n<data>\r\n". The state is kept in c->multibulklen (arguments
+ * still to read) and c->bulklen (length of the next one, -1 until its
+ * header is read), so the request can arrive in any number of reads and
+ * the buffer is scanned only once. Arguments are binary safe. */
+static int parseMultibulkQuery(redisClient *c) {
+    long long ll;
+    int retval;
+
+    if (c->multibulklen == 0) {
+        retval = parseMultibulkHeader(c,'*',REDIS_MAX_MULTIBULK_LEN,&ll);
+        if (retval != 1) return retval;
+        if (ll <= 0) {
+            /* "*0\r\n" and "*-1\r\n" are empty requests, just skip them */
+            c->reqtype = 0;
+            return 2;
+        }
+        /* Don't trust the count for more than a few slots: argv grows as
+         * the arguments actually arrive. */
+        c->multibulklen = ll;
+        clientArgvMakeRoom(c,
+            ll < REDIS_ARGV_PREALLOC ? ll : REDIS_ARGV_PREALLOC);
+    }
+    while(c->multibulklen) {
+        if (c->bulklen == -1) {
+            retval = parseMultibulkHeader(c,'$',REDIS_MAX_BULK_LEN,&ll);
+            if (retval != 1) return retval;
+            if (ll < 0) return -1;
+            c->bulklen = ll;
+        }
+        if ((long)(sdslen(c->querybuf)-c->qb_pos) < c->bulklen+2) return 0;
+        clientArgvMakeRoom(c,c->argc+1);
+        c->argv[c->argc++] = sdsnewlen(c->querybuf+c->qb_pos, c->bulklen);
+        c->qb_pos += c->bulklen+2;
+        c->bulklen = -1;
+        c->multibulklen--;
+    }
+    return 1;
+}
+
+/* Try to extract the next command from the query buffer into the client
+ * argv/argc fields. Returns 1 if a whole command is ready to be executed,
+ * 0 if more data is needed, -1 on protocol errors. Only the client itself
+ * is touched, so the I/O threads can parse ahead of the main thread.
+ *
+ * The query buffer is not modified: parsed data is consumed advancing
+ * c->qb_pos, and compactQueryBuffer() drops it once the whole batch
+ * of commands was processed. */
+int parseClientQuery(redisClient *c) {
+    if (c->flags & REDIS_MEMCACHE) return mcParseRequest(c);
+    while(1) {
+        int retval;
+
+        if (c->qb_pos == (int)sdslen(c->querybuf)) return 0;
+        if (!c->reqtype) {
+            c->reqtype = (c->querybuf[c->qb_pos] == '*') ?
+                REDIS_REQ_MULTIBULK : REDIS_REQ_INLINE;
+        }
+        if (c->reqtype == REDIS_REQ_INLINE)
+            return parseInlineQuery(c);
+        retval = parseMultibulkQuery(c);
+        if (retval != 2) return retval;
+    }
+}
+
+/* Drop the parsed part of the query buffer. This is done once per batch of
+ * commands, so only the incomplete command at the end gets moved. The
+ * buffer is reused for the next reads unless a big request grew it. */
+static void compactQueryBuffer(redisClient *c) {
+    if (c->qb_pos == 0) return;
+    if (c->qb_pos == (int)sdslen(c->querybuf) &&
+        sdsavail(c->querybuf)+c->qb_pos > REDIS_QUERYBUF_MAX_IDLE)
+    {
+        sdsfree(c->querybuf);
+        c->querybuf = sdsempty();
+    } else {
+        c->querybuf = sdsrange(c->querybuf, c->qb_pos, -1);
+    }
+    c->qb_pos = 0;
+}
+
+/* Free a client flagged REDIS_CLOSE_AFTER_REPLY once it has no more input
+ * to process and its reply was completely sent. Returns 1 if the client
+ * was freed. */
+int freeClientIfDone(redisClient *c) {
+    if (!(c->flags & REDIS_CLOSE_AFTER_REPLY) ||
+        c->flags & (REDIS_PENDING_INPUT|REDIS_PENDING_COMMAND) ||
+        c->bufpos || listLength(c->reply)) return 0;
+    redisLog(REDIS_DEBUG, "Client closed connection");
+    freeClient(c);
+    return 1;
+}
+
+/* Execute every command that is complete in the client query buffer. */
+void processInputBuffer(redisClient *c) {
+    int commands = 0;
+    int startpos = c->qb_pos;
+
+    while(1) {
+        if (c->flags & REDIS_CLOSE_ASAP) {
+            freeClient(c);
             return;
         }
+        /* The client is not reading its replies fast enough: don't execute
+         * more commands, and stop reading from the socket as well so that
+         * the client is throttled by TCP, until trimClientReply() sees the
+         * reply shrinking under the threshold. */
+        if (server.obufpause && c->reply_bytes >= server.obufpause &&
+            !(c->flags & REDIS_PENDING_COMMAND))
+        {
+            if (!(c->flags & REDIS_READ_PAUSED)) {
+                c->flags |= REDIS_READ_PAUSED;
+                aeDeleteFileEvent(server.el,c->fd,AE_READABLE);
+            }
+            compactQueryBuffer(c);
+            return;
+        }
+        if (!(c->flags & REDIS_PENDING_COMMAND)) {
+            int retval;
+
+            /* A client pipelining a lot of commands would starve all the
+             * others: once it used its budget, the rest of the query
+             * buffer waits for the next iteration of the event loop. */
+            if ((server.maxcommandsperevent &&
+                 commands >= server.maxcommandsperevent) ||
+                (server.maxbytesperevent &&
+                 c->qb_pos-startpos >= server.maxbytesperevent))
+            {
+                if (c->qb_pos < (int)sdslen(c->querybuf)) {
+                    c->flags |= REDIS_PENDING_INPUT;
+                    if (!listAddNodeTail(server.clients_pending_input,c))
+                        oom("listAddNodeTail");
+                    c->inputnode = listLast(server.clients_pending_input);
+                }
+                compactQueryBuffer(c);
+                return;
+            }
+            retval = parseClientQuery(c);
+
+            if (retval == -1) {
+                redisLog(REDIS_DEBUG, "Client protocol error");
+                freeClient(c);
+                return;
+            }
+            if (retval == 0) {
+                if (freeClientIfDone(c)) return;
+                compactQueryBuffer(c);
+                return;
+            }
+        }
+        c->flags &= ~REDIS_PENDING_COMMAND;
+        commands++;
+        /* Execute the command. If the client is still valid
+         * after processCommand() return try to process the next one. */
+        if (!processCommand(c)) return;
+    }
+}
+
+void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+    
+    redisLog(REDIS_DEBUG, "readQueryFromClient");
+    
+    redisClient *c = (redisClient*) privdata;
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(fd);
+    REDIS_NOTUSED(mask);
+
+    /* With I/O threads the read is deferred to beforeSleep(), where all
+     * the clients that became readable are served in parallel. */
+    if (server.iothreads > 1) {
+        if (!(c->flags & REDIS_PENDING_READ)) {
+            c->flags |= REDIS_PENDING_READ;
+            if (!listAddNodeTail(server.clients_pending_read,c))
+                oom("listAddNodeTail");
+            c->readnode = listLast(server.clients_pending_read);
+        }
+        return;
+    }
+    if (readClientSocket(c) == REDIS_ERR) {
+        redisLog(REDIS_DEBUG, "Error reading from client: %s",
+            strerror(errno));
+        freeClient(c);
+        return;
+    }
+    /* The socket stays readable after EOF */
+    if (c->flags & REDIS_CLOSE_AFTER_REPLY && !server.edgetriggered)
+        aeDeleteFileEvent(server.el,c->fd,AE_READABLE);
+    /* Already used its budget in this iteration */
+    if (c->flags & REDIS_PENDING_INPUT) return;
+    processInputBuffer(c);
+}
+
+/* Resume the clients that were stopped by the per event budget in
+ * processInputBuffer(). The ones that still have input left after this
+ * new round are queued again, to be served in the next iteration. */
+void handleClientsWithPendingInput(void) {
+    unsigned long n = listLength(server.clients_pending_input);
+    listNode *ln;
+
+    while(n-- && (ln = listFirst(server.clients_pending_input)) != NULL) {
+        redisClient *c = listNodeValue(ln);
+
+        listDelNode(server.clients_pending_input,ln);
+        c->flags &= ~REDIS_PENDING_INPUT;
+        processInputBuffer(c);
     }
 }
 
@@ -738,64 +1514,267 @@ int selectDb(redisClient *c, int id) {
     return REDIS_OK;
 }
 
-int createClient(int fd) {
+int createClient(int fd, int flags) {
     redisClient *c = malloc(sizeof(*c));
+    int edge = server.edgetriggered ? AE_EDGE : 0;
 
-    anetNonBlock(NULL,fd);
-    anetTcpNoDelay(NULL,fd);
     if (!c) return REDIS_ERR;
     selectDb(c,0);
     c->fd = fd;
     c->querybuf = sdsempty();
+    c->qb_pos = 0;
+    c->argv = NULL;
     c->argc = 0;
+    c->argvlen = 0;
+    c->reqtype = 0;
+    c->multibulklen = 0;
     c->bulklen = -1;
     c->sentlen = 0;
-    c->lastinteraction = time(NULL);
+    c->sentobjs = 0;
+    c->bufpos = 0;
+    c->reply_bytes = 0;
+    c->softlimitsince = 0;
+    c->flags = flags;
+    c->capture = NULL;
+    c->lastinteraction = server.unixtime;
     if ((c->reply = listCreate()) == NULL) oom("listCreate");
     listSetFreeMethod(c->reply,decrRefCount);
-    if (aeCreateFileEvent(server.el, c->fd, AE_READABLE,
+    if (!listAddNodeTail(server.clients,c)) oom("listAddNodeTail");
+    c->node = listLast(server.clients);
+    addClientTimeout(c);
+    if (aeCreateFileEvent(server.el, c->fd, AE_READABLE|edge,
         readQueryFromClient, c) == AE_ERR) {
         freeClient(c);
         return REDIS_ERR;
     }
-    if (!listAddNodeTail(server.clients,c)) oom("listAddNodeTail");
+    /* In edge triggered mode the writable event is registered once for
+     * all: replies are written by beforeSleep(), and the event only fires
+     * when a reply that didn't fit the socket buffer can be resumed. */
+    if (server.edgetriggered && aeCreateFileEvent(server.el, c->fd,
+        AE_WRITABLE|AE_EDGE, sendReplyToClient, c) == AE_ERR) {
+        freeClient(c);
+        return REDIS_ERR;
+    }
     return REDIS_OK;
 }
 
-void addReply(redisClient *c, robj *obj) {
-    if (listLength(c->reply) == 0 &&
-        aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
-        sendReplyToClient, c) == AE_ERR) return;
+/* Make sure the reply we are going to queue will reach the client: the
+ * write handler is installed right away, or with I/O threads enabled the
+ * client is queued so that beforeSleep() writes all the replies in
+ * parallel. The same happens in edge triggered mode, where the write
+ * handler is always registered and would not fire for a socket that was
+ * already writable. */
+static int prepareClientToWrite(redisClient *c) {
+    if (c->flags & REDIS_CLOSE_ASAP) return REDIS_ERR;
+    /* Already done for the replies that are still pending */
+    if (c->bufpos || listLength(c->reply)) return REDIS_OK;
+    if (server.iothreads > 1 || server.edgetriggered) {
+        if (!(c->flags & REDIS_PENDING_WRITE)) {
+            c->flags |= REDIS_PENDING_WRITE;
+            if (!listAddNodeTail(server.clients_pending_write,c))
+                oom("listAddNodeTail");
+            c->writenode = listLast(server.clients_pending_write);
+        }
+        return REDIS_OK;
+    }
+    if (aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
+        sendReplyToClient, c) == AE_ERR) return REDIS_ERR;
+    return REDIS_OK;
+}
+
+/* Enforce the output buffer limits of the client class after a reply was
+ * queued. The client can't be freed here, since we are usually called by
+ * a command proc, so it's just flagged REDIS_CLOSE_ASAP and
+ * processInputBuffer() frees it when the command returns. */
+static void checkClientOutputBufferLimits(redisClient *c) {
+    int class = (c->flags & REDIS_MEMCACHE) ? REDIS_CLIENT_MEMCACHE :
+                                               REDIS_CLIENT_NORMAL;
+    struct clientBufferLimits *l = server.obuflimits+class;
+    int close = 0;
+
+    if (l->hard && c->reply_bytes > l->hard) {
+        close = 1;
+    } else if (l->soft && c->reply_bytes > l->soft) {
+        if (c->softlimitsince == 0) {
+            c->softlimitsince = server.unixtime;
+        } else if (server.unixtime - c->softlimitsince > l->softseconds) {
+            close = 1;
+        }
+    } else {
+        c->softlimitsince = 0;
+    }
+    if (close) {
+        redisLog(REDIS_NOTICE,"Client closed for exceeding its output "
+            "buffer limits (%llu bytes pending)", c->reply_bytes);
+        c->flags |= REDIS_CLOSE_ASAP;
+    }
+}
+
+/* Copy the reply in the inline buffer of the client if it fits. This is
+ * only possible as long as the reply list is empty, since the buffer is
+ * sent first. */
+static int addReplyToBuffer(redisClient *c, const char *s, size_t len) {
+    if (listLength(c->reply) || len > sizeof(c->buf)-c->bufpos)
+        return REDIS_ERR;
+    memcpy(c->buf+c->bufpos,s,len);
+    c->bufpos += len;
+    return REDIS_OK;
+}
+
+static void addReplyObjectToList(redisClient *c, robj *obj) {
     if (!listAddNodeTail(c->reply,obj)) oom("listAddNodeTail");
     incrRefCount(obj);
+    c->reply_bytes += sdslen(obj->ptr);
+    checkClientOutputBufferLimits(c);
 }
 
+void addReply(redisClient *c, robj *obj) {
+    if (c->capture) {
+        c->capture = sdscatlen(c->capture,obj->ptr,sdslen(obj->ptr));
+        return;
+    }
+    if (prepareClientToWrite(c) == REDIS_ERR) return;
+    if (addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) == REDIS_OK) return;
+    addReplyObjectToList(c,obj);
+}
+
+/* Like addReply() but takes ownership of the string, that is freed as
+ * soon as it gets copied: an object is only created when the string
+ * has to go in the reply list. */
 void addReplySds(redisClient *c, sds s) {
-    robj *o = createObject(REDIS_STRING,s);
-    addReply(c,o);
+    robj *o;
+
+    if (c->capture) {
+        c->capture = sdscatlen(c->capture,s,sdslen(s));
+        sdsfree(s);
+        return;
+    }
+    if (prepareClientToWrite(c) == REDIS_ERR ||
+        addReplyToBuffer(c,s,sdslen(s)) == REDIS_OK)
+    {
+        sdsfree(s);
+        return;
+    }
+    o = createObject(REDIS_STRING,s);
+    addReplyObjectToList(c,o);
     decrRefCount(o);
 }
 
-void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
-    int cport, cfd;
-    char cip[128];
-    REDIS_NOTUSED(el);
-    REDIS_NOTUSED(mask);
-    REDIS_NOTUSED(privdata);
+/* Like addReplySds() for a string that is not an sds: it is just copied
+ * in the inline buffer whenever possible. */
+void addReplyString(redisClient *c, const char *s, size_t len) {
+    robj *o;
+
+    if (c->capture) {
+        c->capture = sdscatlen(c->capture,(void*)s,len);
+        return;
+    }
+    if (prepareClientToWrite(c) == REDIS_ERR ||
+        addReplyToBuffer(c,s,len) == REDIS_OK) return;
+    o = createObject(REDIS_STRING,sdsnewlen(s,len));
+    addReplyObjectToList(c,o);
+    decrRefCount(o);
+}
+
+/* Reply with "<ll>\r\n", that is both an integer reply and the length
+ * line of a bulk or multi bulk reply. */
+void addReplyLongLong(redisClient *c, long long ll) {
+    char buf[SDS_LLSTR_SIZE+2];
+    int len;
+
+    if (ll >= 0 && ll < REDIS_SHARED_BULKHDR_LEN) {
+        addReply(c,shared.bulkhdr[ll]);
+        return;
+    }
+    len = sdsll2str(buf,ll);
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    addReplyString(c,buf,len);
+}
+
+/* Reply with the string object as a bulk: length line, data, CRLF */
+void addReplyBulk(redisClient *c, robj *obj) {
+    addReplyLongLong(c,sdslen(obj->ptr));
+    addReply(c,obj);
+    addReply(c,shared.crlf);
+}
+
+static void acceptCommonHandler(int cfd, int flags) {
+    if (server.maxclients && listLength(server.clients) >= server.maxclients) {
+        char *err = "-ERR max number of clients reached\r\n";
 
-    cfd = anetAccept(server.neterr, fd, cip, &cport);
-    if (cfd == AE_ERR) {
-        redisLog(REDIS_DEBUG,"Accepting client connection: %s", server.neterr);
+        /* That's a best effort error message, don't check write errors */
+        if (write(cfd,err,strlen(err)) == -1) {
+            /* Nothing to do, Just to avoid the warning... */
+        }
+        close(cfd);
         return;
     }
-    redisLog(REDIS_DEBUG,"Accepted %s:%d", cip, cport);
-    if (createClient(cfd) == REDIS_ERR) {
+    if (createClient(cfd,flags) == REDIS_ERR) {
         redisLog(REDIS_WARNING,"Error allocating resoures for the client");
         close(cfd); /* May be already closed, just ingore errors */
         return;
     }
 }
 
+/* The listening socket is non blocking: accept all the pending connections
+ * at once, so that a burst of reconnecting clients doesn't cost an event
+ * loop iteration per client while the listen queue overflows. */
+static void acceptTcpConnections(int fd, int flags) {
+    int cport, cfd, max = REDIS_MAX_ACCEPTS_PER_CALL;
+    char cip[128];
+
+    while(max--) {
+        cfd = anetAccept(server.neterr, fd, cip, &cport);
+        if (cfd == AE_ERR) {
+            if (errno != EAGAIN)
+                redisLog(REDIS_DEBUG,"Accepting client connection: %s",
+                    server.neterr);
+            return;
+        }
+        redisLog(REDIS_DEBUG,"Accepted %s:%d", cip, cport);
+        anetTcpNoDelay(NULL,cfd);
+        acceptCommonHandler(cfd,flags);
+    }
+}
+
+void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(mask);
+    REDIS_NOTUSED(privdata);
+
+    acceptTcpConnections(fd,0);
+}
+
+/* Clients of the memcached port, see memcache.c */
+void acceptMemcacheHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(mask);
+    REDIS_NOTUSED(privdata);
+
+    acceptTcpConnections(fd,REDIS_MEMCACHE);
+}
+
+/* Same as acceptHandler() for the clients connecting via unix socket. */
+void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    int cfd, max = REDIS_MAX_ACCEPTS_PER_CALL;
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(mask);
+    REDIS_NOTUSED(privdata);
+
+    while(max--) {
+        cfd = anetUnixAccept(server.neterr, fd);
+        if (cfd == AE_ERR) {
+            if (errno != EAGAIN)
+                redisLog(REDIS_DEBUG,"Accepting client connection: %s",
+                    server.neterr);
+            return;
+        }
+        redisLog(REDIS_DEBUG,"Accepted connection to %s", server.unixsocket);
+        acceptCommonHandler(cfd,0);
+    }
+}
+
 /* ======================= Redis objects implementation ===================== */
 robj *createObject(int type, void *ptr) {
     robj *o;
@@ -809,6 +1788,7 @@ robj *createObject(int type, void *ptr) {
     }
     if (!o) oom("createObject");
     o->type = type;
+    o->mcflags = 0;
     o->ptr = ptr;
     o->refcount = 1;
     return o;
@@ -857,7 +1837,6 @@ void decrRefCount(void *obj) {
 /* =================================== Main! ================================ */
 int main(int argc, char **argv) {
     initServerConfig();
-    initServer();
     if (argc == 2) {
         ResetServerSaveParams();
         loadServerConfig(argv[1]);
@@ -866,11 +1845,19 @@ int main(int argc, char **argv) {
         fprintf(stderr,"Usage: ./redis-server [/path/to/redis.conf]\n");
         exit(1);
     }
-    redisLog(REDIS_NOTICE,"Server started");
+    initServer();
+    redisLog(REDIS_NOTICE,"Server started, using the %s event loop",
+        aeApiName());
     if (loadDb("dump.rdb") == REDIS_OK)
         redisLog(REDIS_NOTICE,"DB loaded from disk");
     if (aeCreateFileEvent(server.el, server.fd, AE_READABLE,
         acceptHandler, NULL) == AE_ERR) oom("creating file event");
+    if (server.sofd != -1 && aeCreateFileEvent(server.el, server.sofd,
+        AE_READABLE, acceptUnixHandler, NULL) == AE_ERR)
+        oom("creating file event");
+    if (server.mcfd != -1 && aeCreateFileEvent(server.el, server.mcfd,
+        AE_READABLE, acceptMemcacheHandler, NULL) == AE_ERR)
+        oom("creating file event");
     redisLog(REDIS_NOTICE,"The server is now ready to accept connections");
     aeMain(server.el);
     aeDeleteEventLoop(server.el);
@@ -13,20 +13,45 @@
 /* server configuration */
 #define REDIS_SERVERPORT        6379    /* TCP port */
 #define REDIS_MAXIDLETIME       (60*5)  /* default client timeout */
-#define REDIS_QUERYBUF_LEN      1024
+#define REDIS_QUERYBUF_LEN      (1024*16) /* Bytes read() at once */
+#define REDIS_INLINE_MAX_SIZE   1024    /* Max length of an inline command */
+#define REDIS_QUERYBUF_MAX_IDLE (1024*64) /* Larger empty buffers are freed */
 #define REDIS_LOADBUF_LEN       1024
-#define REDIS_MAX_ARGS          16
+#define REDIS_ARGV_MIN          16      /* argv slots allocated at first */
+#define REDIS_MAX_MULTIBULK_LEN (1024*1024) /* Max arguments of a request */
+#define REDIS_ARGV_PREALLOC     1024    /* Max argv slots allocated upfront */
+#define REDIS_MAX_BULK_LEN      (512*1024*1024) /* Max length of an argument */
 #define REDIS_DEFAULT_DBNUM     16
 #define REDIS_CONFIGLINE_MAX    1024
+#define REDIS_IOTHREADS_MAX     128
+#define REDIS_IOV_MAX           1024    /* Max objects per writev() */
+#define REDIS_SHARED_BULKHDR_LEN 10000 /* Shared "<len>\r\n" objects */
+#define REDIS_REPLY_CHUNK_BYTES (16*1024) /* Inline reply buffer of clients */
+#define REDIS_EVENTLOOP_SETSIZE 1024    /* Initial fd tables, grown on demand */
+#define REDIS_EVENTLOOP_FDSET_INCR 32   /* fds beside clients: listener, logs */
+#define REDIS_TCP_BACKLOG       511     /* listen() backlog */
+#define REDIS_MAX_ACCEPTS_PER_CALL 1000 /* accept() calls per readable event */
+#define REDIS_MAX_COMMANDS_PER_EVENT 1000 /* Commands run per client and event */
+#define REDIS_MAX_BYTES_PER_EVENT (1024*1024) /* Query bytes consumed as well */
+#define REDIS_OUTPUT_PAUSE_BYTES (1024*1024*4) /* Stop reading past this reply */
+#define REDIS_LOG_RING_SIZE     4096    /* Queued log messages, power of 2 */
+#define REDIS_LOG_MSG_LEN       1024    /* Longer log messages are truncated */
+#define REDIS_TIMEOUT_WHEEL_SIZE 1024   /* Idle timeout buckets, one per second */
 
 /* Hash table parameters */
 #define REDIS_HT_MINFILL        10      /* Minimal hash table fill 10% */
 #define REDIS_HT_MINSLOTS       16384   /* Never resize the HT under this */
+#define REDIS_HT_REHASH_MS      1       /* Rehashing time per table and cron */
+#define REDIS_EMBED_KEY_MAX     64      /* Longest key stored in dict entries */
 
 /* Command types */
 #define REDIS_CMD_BULK          1
 #define REDIS_CMD_INLINE        0
 
+/* Request protocols */
+#define REDIS_REQ_INLINE        1   /* "cmd arg arg\r\n", maybe with a bulk */
+#define REDIS_REQ_MULTIBULK     2   /* "*<argc>\r\n$<len>\r\n<arg>\r\n..." */
+
 /* Object types */
 #define REDIS_STRING 0
 #define REDIS_LIST 1
@@ -38,6 +63,21 @@
 #define REDIS_HEAD 0
 #define REDIS_TAIL 1
 
+/* Client flags */
+#define REDIS_CLOSE_ASAP        1   /* I/O thread hit EOF or an error */
+#define REDIS_PENDING_READ      2   /* Queued in server.clients_pending_read */
+#define REDIS_PENDING_WRITE     4   /* Queued in server.clients_pending_write */
+#define REDIS_PENDING_COMMAND   8   /* argv holds a command ready to execute */
+#define REDIS_MEMCACHE          16  /* Speaks the memcached binary protocol */
+#define REDIS_PENDING_INPUT     32  /* Queued in server.clients_pending_input */
+#define REDIS_READ_PAUSED       64  /* Not read until its reply is drained */
+#define REDIS_CLOSE_AFTER_REPLY 128 /* Half closed, freed once its replies are sent */
+
+/* Client classes, each one with its output buffer limits */
+#define REDIS_CLIENT_NORMAL     0
+#define REDIS_CLIENT_MEMCACHE   1
+#define REDIS_CLIENT_CLASSES    2
+
 /* Log levels */
 #define REDIS_DEBUG 0
 #define REDIS_NOTICE 1
@@ -54,17 +94,35 @@ typedef struct redisClient {
     int fd;
     dict *dict;
     sds querybuf;
-    sds argv[REDIS_MAX_ARGS];
+    int qb_pos;     /* bytes of querybuf already parsed */
+    sds *argv;
     int argc;
-    int bulklen;    /* bulk read len. -1 if not in bulk read mode */
+    int argvlen;    /* allocated argv slots */
+    int reqtype;    /* REDIS_REQ_*, 0 until the request type is known */
+    int multibulklen; /* multi bulk arguments left to read */
+    long bulklen;   /* bulk read len. -1 if not in bulk read mode */
     list *reply;
-    int sentlen;
+    unsigned long long reply_bytes; /* Total length of the reply objects */
+    time_t softlimitsince;  /* Above the soft output limit since, or 0 */
+    int sentlen;    /* bytes of buf, or of the first reply object, sent */
+    int sentobjs;   /* reply objects fully written but still in the list */
+    int flags;      /* REDIS_CLOSE_ASAP | REDIS_PENDING_... */
     time_t lastinteraction; /* time of the last interaction, used for timeout */
+    listNode *node;         /* node of this client in server.clients */
+    listNode *timeoutnode;  /* node in the server.timeouts bucket ... */
+    int timeoutslot;        /* ... with this index */
+    listNode *readnode;     /* node in server.clients_pending_read */
+    listNode *writenode;    /* node in server.clients_pending_write */
+    listNode *inputnode;    /* node in server.clients_pending_input */
+    sds capture;            /* If not NULL replies are appended here */
+    int bufpos;             /* bytes used in buf */
+    char buf[REDIS_REPLY_CHUNK_BYTES]; /* Replies, sent before c->reply */
 } redisClient;
 
 /* A redis object, that is a type able to hold a string / list / set */
 typedef struct redisObject {
     int type;
+    unsigned int mcflags;   /* Flags of the memcached protocol, see memcache.c */
     void *ptr;
     int refcount;
 } robj;
@@ -74,11 +132,26 @@ struct saveparam {
     int changes;
 };
 
+/* Output buffer limits of a client class, 0 = no limit. A client is closed
+ * as soon as its pending reply exceeds the hard limit, or when it stays over
+ * the soft one for more than softseconds. */
+struct clientBufferLimits {
+    unsigned long long hard;
+    unsigned long long soft;
+    time_t softseconds;
+};
+
 /* Global server state structure */
 struct redisServer {
     int port;
     int fd;
+    char *unixsocket;           /* Path of the unix socket, NULL = none */
+    mode_t unixsocketperm;      /* Mode of the unix socket file, 0 = umask */
+    int sofd;                   /* Unix socket listener, -1 if not enabled */
+    int mcport;                 /* Memcached protocol port, 0 = disabled */
+    int mcfd;                   /* Memcached protocol listener, or -1 */
     dict **dict;
+    dict *commands;             /* Command table, see populateCommandTable() */
     long long dirty;            /* changes to DB from the last save */
     list *clients;
     char neterr[ANET_ERR_LEN];
@@ -92,12 +165,32 @@ struct redisServer {
     time_t lastsave;
     struct saveparam *saveparams;
     int saveparamslen;
+    int hashalgorithm;          /* DICT_HASH_WYHASH or DICT_HASH_SIPHASH */
+    int *flatdbs;               /* Databases with open addressing dicts, */
+    int flatdbslen;             /* -1 = all, see dictCreateFlat() */
     char *logfile;
+    int backlog;                /* listen() backlog */
+    int maxclients;             /* 0 = no limit */
+    int iothreads;              /* Number of I/O threads, 1 = main thread only */
+    int edgetriggered;          /* Register clients with AE_EDGE */
+    list *clients_pending_read; /* Clients to read from in beforeSleep() */
+    list *clients_pending_write;/* Clients to write to in beforeSleep() */
+    list *clients_pending_input;/* Clients that used their budget with some
+                                 * input left, resumed in beforeSleep() */
+    int maxcommandsperevent;    /* Per client budget in every iteration of */
+    long long maxbytesperevent; /* the event loop, 0 = no limit */
+    struct clientBufferLimits obuflimits[REDIS_CLIENT_CLASSES];
+    unsigned long long obufpause; /* Pause reading past this reply, 0 = never */
+    list *timeouts[REDIS_TIMEOUT_WHEEL_SIZE]; /* Clients by lastinteraction */
+    time_t timeoutcheck;        /* Idle clients closed up to this second */
+    time_t unixtime;            /* Cached wall clock, see updateCachedTime() */
+    long long mstime;           /* Cached monotonic clock in milliseconds */
 };
 
 
 struct sharedObjectsStruct {
     robj *crlf, *ok, *err, *zerobulk, *nil, *zero, *one, *pong;
+    robj *bulkhdr[REDIS_SHARED_BULKHDR_LEN]; /* "0\r\n", "1\r\n", ... */
 } shared;
 
 
@@ -109,8 +202,22 @@ void freeSetObject(robj *o);
 void decrRefCount(void *o);
 robj *createObject(int type, void *ptr);
 void freeClient(redisClient *c);
+int readClientSocket(redisClient *c);
+int parseClientQuery(redisClient *c);
+void clientArgvMakeRoom(redisClient *c, int n);
+void resetClient(redisClient *c);
+int writeToClient(redisClient *c);
+void trimClientReply(redisClient *c);
+int freeClientIfDone(redisClient *c);
+void processInputBuffer(redisClient *c);
+void handleClientsWithPendingInput(void);
+void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask);
+void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask);
 void addReply(redisClient *c, robj *obj);
 void addReplySds(redisClient *c, sds s);
+void addReplyString(redisClient *c, const char *s, size_t len);
+void addReplyLongLong(redisClient *c, long long ll);
+void addReplyBulk(redisClient *c, robj *obj);
 void incrRefCount(robj *o);
 int selectDb(redisClient *c, int id);
 
@@ -118,12 +225,21 @@ int selectDb(redisClient *c, int id);
 int stringmatchlen(const char *pattern, int patternLen,
         const char *string, int stringLen, int nocase);
 
-void redisLog(int level, const char *fmt, ...);
+void _redisLog(int level, const char *fmt, ...);
 void oom(const char *msg);
+int string2ll(const char *s, size_t slen, long long *value);
+long long memtoll(const char *p, int *err);
+void updateCachedTime(void);
 
 robj *createListObject(void);
 
 
 extern struct redisServer server;
 
+/* The level is checked before calling _redisLog(), so filtered messages
+ * cost a comparison and no argument is evaluated. */
+#define redisLog(level, ...) do { \
+    if ((level) >= server.verbosity) _redisLog(level, __VA_ARGS__); \
+} while(0)
+
 #endif
\ No newline at end of file
@@ -58,6 +58,24 @@ sds sdsnewlen(const void *init, size_t initlen) {
     return (char*)sh->buf;
 }
 
+/* Build a string of 'initlen' bytes in 'buf', that must have room for
+ * sdsembedsize(initlen) bytes, for strings stored inside another
+ * allocation. Such a string can be read like any other but must never be
+ * freed or grown. */
+sds sdsembed(void *buf, const void *init, size_t initlen) {
+    struct sdshdr *sh = buf;
+
+    sh->len = initlen;
+    sh->free = 0;
+    memcpy(sh->buf, init, initlen);
+    sh->buf[initlen] = '\0';
+    return (char*)sh->buf;
+}
+
+size_t sdsembedsize(size_t initlen) {
+    return sizeof(struct sdshdr)+initlen+1;
+}
+
 sds sdsempty(void) {
     return sdsnewlen("",0);
 }
@@ -93,7 +111,9 @@ void sdsupdatelen(sds s) {
     sh->len = reallen;
 }
 
-static sds sdsMakeRoomFor(sds s, size_t addlen) {
+/* Make sure there are at least 'addlen' free bytes at the end of the string,
+ * so that the caller can write there directly and then call sdsIncrLen(). */
+sds sdsMakeRoomFor(sds s, size_t addlen) {
     struct sdshdr *sh, *newsh;
     size_t free = sdsavail(s);
     size_t len, newlen;
@@ -113,6 +133,16 @@ static sds sdsMakeRoomFor(sds s, size_t addlen) {
     return newsh->buf;
 }
 
+/* Account for 'incr' bytes the caller wrote after the end of the string,
+ * in the free space obtained with sdsMakeRoomFor(). */
+void sdsIncrLen(sds s, size_t incr) {
+    struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
+
+    sh->len += incr;
+    sh->free -= incr;
+    s[sh->len] = '\0';
+}
+
 sds sdscatlen(sds s, void *t, size_t len) {
     struct sdshdr *sh;
     size_t curlen = sdslen(s);
@@ -152,8 +182,57 @@ sds sdscpy(sds s, char *t) {
     return sdscpylen(s, t, strlen(t));
 }
 
+/* Every number from 00 to 99, so that sdsll2str() emits two digits for
+ * every division. */
+static const char sdsdigitpairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Write the decimal representation of 'value' into 's', that must have
+ * room for SDS_LLSTR_SIZE bytes, and return the length of the string.
+ * The result is null terminated. This is much faster than snprintf(). */
+int sdsll2str(char *s, long long value) {
+    char buf[SDS_LLSTR_SIZE], *p = buf+sizeof(buf);
+    unsigned long long v;
+    int len;
+
+    /* The negation is done unsigned, so that LLONG_MIN works as well */
+    v = (value < 0) ? -(unsigned long long)value : (unsigned long long)value;
+    while(v >= 100) {
+        int i = (v % 100)*2;
+
+        v /= 100;
+        *--p = sdsdigitpairs[i+1];
+        *--p = sdsdigitpairs[i];
+    }
+    if (v < 10) {
+        *--p = '0'+v;
+    } else {
+        int i = v*2;
+
+        *--p = sdsdigitpairs[i+1];
+        *--p = sdsdigitpairs[i];
+    }
+    if (value < 0) *--p = '-';
+    len = buf+sizeof(buf)-p;
+    memcpy(s,p,len);
+    s[len] = '\0';
+    return len;
+}
+
+/* Create an sds string from a long long value */
+sds sdsfromlonglong(long long value) {
+    char buf[SDS_LLSTR_SIZE];
+    int len = sdsll2str(buf,value);
+
+    return sdsnewlen(buf,len);
+}
+
 sds sdscatprintf(sds s, const char *fmt, ...) {
-    va_list ap;
+    va_list ap, cpy;
     char *buf, *t;
     size_t buflen = 32;
 
@@ -166,7 +245,10 @@ sds sdscatprintf(sds s, const char *fmt, ...) {
         if (buf == NULL) return NULL;
 #endif
         buf[buflen-2] = '\0';
-        vsnprintf(buf, buflen, fmt, ap);
+        /* Every attempt needs its own copy of the arguments */
+        va_copy(cpy, ap);
+        vsnprintf(buf, buflen, fmt, cpy);
+        va_end(cpy);
         if (buf[buflen-2] != '\0') {
             free(buf);
             buflen *= 2;
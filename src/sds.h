@@ -32,6 +32,9 @@
 /* simple dynamic string */
 typedef char *sds;
 
+/* Bytes needed by sdsll2str() for any long long, null term included */
+#define SDS_LLSTR_SIZE 21
+
 struct sdshdr {
     long len;
     long free;
@@ -40,6 +43,8 @@ struct sdshdr {
 
 sds sdsnewlen(const void *init, size_t initlen);
 sds sdsnew(const char *init);
+sds sdsembed(void *buf, const void *init, size_t initlen);
+size_t sdsembedsize(size_t initlen);
 sds sdsempty();
 size_t sdslen(const sds s);
 sds sdsdup(const sds s);
@@ -50,9 +55,13 @@ sds sdscat(sds s, char *t);
 sds sdscpylen(sds s, char *t, size_t len);
 sds sdscpy(sds s, char *t);
 sds sdscatprintf(sds s, const char *fmt, ...);
+int sdsll2str(char *s, long long value);
+sds sdsfromlonglong(long long value);
 sds sdstrim(sds s, const char *cset);
 sds sdsrange(sds s, long start, long end);
 void sdsupdatelen(sds s);
+sds sdsMakeRoomFor(sds s, size_t addlen);
+void sdsIncrLen(sds s, size_t incr);
 int sdscmp(sds s1, sds s2);
 sds *sdssplitlen(char *s, int len, char *sep, int seplen, int *count);
 void sdstolower(sds s);
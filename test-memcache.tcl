@@ -0,0 +1,249 @@
+# Tests of the memcached binary protocol frontend, run against a server
+# started with "memcachedport" set:
+#
+#   tclsh test-memcache.tcl [host] [port]
+
+set ::passed 0
+set ::failed 0
+
+proc test {name code okpattern} {
+    puts -nonewline [format "%-70s " $name]
+    flush stdout
+    set retval [uplevel 1 $code]
+    if {$okpattern eq $retval || [string match $okpattern $retval]} {
+        puts "PASSED"
+        incr ::passed
+    } else {
+        puts "!! ERROR expected '$okpattern' but got '$retval'"
+        incr ::failed
+    }
+}
+
+proc main {server port} {
+    set fd [mc_connect $server $port]
+
+    test {DELETE the keys used by the tests to start clean} {
+        foreach key {foo bar ctr big mc_a mc_b mc_c mc_d} {
+            mc_write $fd 0x14 $key
+        }
+        mc_write $fd 0x0a
+        flush $fd
+        # The misses are errors, so DELETEQ replies to them
+        set ops {}
+        while 1 {
+            set r [mc_read $fd]
+            lappend ops [lindex $r 0]
+            if {[lindex $r 0] == 0x0a} break
+        }
+        lindex $ops end
+    } {10}
+
+    test {SET and GET an item} {
+        mc_set $fd foo bar
+        mc_result [mc_call $fd 0x00 foo]
+    } {0 0 {} bar}
+
+    test {SET and GET a binary value} {
+        mc_set $fd foo "a\r\n\x00b"
+        lindex [mc_call $fd 0x00 foo] 5
+    } "a\r\n\x00b"
+
+    test {SET with flags, GET returns them} {
+        mc_set $fd foo bar 3735928559
+        mc_result [mc_call $fd 0x00 foo]
+    } {0 3735928559 {} bar}
+
+    test {GETK echoes the key} {
+        mc_result [mc_call $fd 0x0c foo]
+    } {0 3735928559 foo bar}
+
+    test {GET against a missing key} {
+        mc_result [mc_call $fd 0x00 nokey]
+    } {1 {} {} {Not found}}
+
+    test {GETK against a missing key echoes the key} {
+        mc_result [mc_call $fd 0x0c nokey]
+    } {1 {} nokey {Not found}}
+
+    test {SET and GET a big value} {
+        mc_set $fd big [string repeat "abcd" 100000]
+        string length [lindex [mc_call $fd 0x00 big] 5]
+    } {400000}
+
+    test {The opaque is echoed} {
+        lindex [mc_call $fd 0x00 foo {} {} 12345] 2
+    } {12345}
+
+    test {GETQ and GETKQ batch ended by NOOP, misses are not replied} {
+        mc_write $fd 0x09 nokey {} {} 1
+        mc_write $fd 0x09 foo {} {} 2
+        mc_write $fd 0x0d nokey {} {} 3
+        mc_write $fd 0x0d foo {} {} 4
+        mc_write $fd 0x0a {} {} {} 5
+        flush $fd
+        set res {}
+        foreach i {1 2 3} {
+            set r [mc_read $fd]
+            lappend res [lindex $r 0] [lindex $r 2] [lindex $r 4]
+        }
+        set res
+    } {9 2 {} 13 4 foo 10 5 {}}
+
+    test {SETQ batch ended by NOOP only gets the NOOP response} {
+        for {set i 0} {$i < 1000} {incr i} {
+            mc_write $fd 0x11 mc_a $i [binary format II 0 0]
+        }
+        mc_write $fd 0x0a {} {} {} 7
+        flush $fd
+        set r [mc_read $fd]
+        list [lindex $r 0] [lindex $r 2] [lindex [mc_call $fd 0x00 mc_a] 5]
+    } {10 7 999}
+
+    test {DELETE an existing key} {
+        mc_set $fd mc_b x
+        set r [mc_result [mc_call $fd 0x04 mc_b]]
+        list $r [lindex [mc_call $fd 0x00 mc_b] 1]
+    } {{0 {} {} {}} 1}
+
+    test {DELETE against a missing key} {
+        mc_result [mc_call $fd 0x04 mc_b]
+    } {1 {} {} {Not found}}
+
+    test {DELETEQ against a missing key still replies with the error} {
+        mc_write $fd 0x14 mc_b
+        mc_write $fd 0x0a
+        flush $fd
+        set r [mc_read $fd]
+        list [lindex $r 0] [lindex $r 1] [lindex [mc_read $fd] 0]
+    } {20 1 10}
+
+    test {INCREMENT against a missing key creates it with the initial value} {
+        mc_incr_value [mc_call $fd 0x05 ctr {} [mc_incr_extras 5 100 0]]
+    } {100}
+
+    test {INCREMENT against the key it created} {
+        mc_incr_value [mc_call $fd 0x05 ctr {} [mc_incr_extras 5 100 0]]
+    } {105}
+
+    test {INCREMENT against a key set with SET, flags are preserved} {
+        mc_set $fd mc_c 10 42
+        mc_call $fd 0x05 mc_c {} [mc_incr_extras 7 0 0]
+        mc_result [mc_call $fd 0x00 mc_c]
+    } {0 42 {} 17}
+
+    test {INCREMENT with expiration 0xffffffff doesn't create the key} {
+        set r [mc_result [mc_call $fd 0x05 mc_d {} \
+            [mc_incr_extras 1 0 0xffffffff]]]
+        list $r [lindex [mc_call $fd 0x00 mc_d] 1]
+    } {{1 {} {} {Not found}} 1}
+
+    test {INCREMENT with expiration 0xffffffff against an existing key} {
+        mc_incr_value [mc_call $fd 0x05 ctr {} \
+            [mc_incr_extras 1 0 0xffffffff]]
+    } {106}
+
+    test {INCREMENTQ is not replied on success} {
+        mc_write $fd 0x15 ctr {} [mc_incr_extras 4 0 0]
+        mc_write $fd 0x0a
+        flush $fd
+        list [lindex [mc_read $fd] 0] \
+             [mc_incr_value [mc_call $fd 0x05 ctr {} [mc_incr_extras 0 0 0]]]
+    } {10 110}
+
+    test {INCREMENT against a non numeric value} {
+        lindex [mc_call $fd 0x05 foo {} [mc_incr_extras 1 0 0]] 1
+    } {6}
+
+    test {SET with an expiration is not supported} {
+        set r [mc_call $fd 0x01 mc_d x [binary format II 0 60]]
+        list [lindex $r 1] [lindex [mc_call $fd 0x00 mc_d] 1]
+    } {131 1}
+
+    test {INCREMENT with an expiration is not supported} {
+        lindex [mc_call $fd 0x05 mc_d {} [mc_incr_extras 1 0 60]] 1
+    } {131}
+
+    test {SET with wrong extras is rejected} {
+        lindex [mc_call $fd 0x01 mc_d x] 1
+    } {4}
+
+    test {Unknown opcode} {
+        lindex [mc_call $fd 0x30 foo] 1
+    } {129}
+
+    test {NOOP} {
+        mc_result [mc_call $fd 0x0a]
+    } {0 {} {} {}}
+
+    # Leave the DB as we found it
+    foreach key {foo ctr big mc_a mc_c} {
+        mc_call $fd 0x04 $key
+    }
+    close $fd
+    puts "\n[expr $::passed+$::failed] tests, $::passed passed, $::failed failed"
+    if {$::failed > 0} {
+        puts "\n*** WARNING!!! $::failed FAILED TESTS ***\n"
+    }
+}
+
+proc mc_connect {server port} {
+    set fd [socket $server $port]
+    fconfigure $fd -translation binary
+    return $fd
+}
+
+# Queue a request: the 24 bytes header, the extras, the key and the value.
+proc mc_write {fd opcode {key {}} {value {}} {extras {}} {opaque 0}} {
+    set key [encoding convertto utf-8 $key]
+    set bodylen [expr {[string length $extras]+[string length $key]+
+                       [string length $value]}]
+    puts -nonewline $fd [binary format ccSccSIIW 0x80 $opcode \
+        [string length $key] [string length $extras] 0 0 $bodylen $opaque 0]
+    puts -nonewline $fd $extras$key$value
+}
+
+# Read a response as {opcode status opaque extras key value}
+proc mc_read fd {
+    set h [read $fd 24]
+    binary scan $h cucuSucucuSuIuIu magic opcode keylen extlen \
+        datatype status bodylen opaque
+    set body [read $fd $bodylen]
+    list $opcode $status $opaque \
+        [string range $body 0 [expr {$extlen-1}]] \
+        [string range $body $extlen [expr {$extlen+$keylen-1}]] \
+        [string range $body [expr {$extlen+$keylen}] end]
+}
+
+proc mc_call {fd opcode {key {}} {value {}} {extras {}} {opaque 0}} {
+    mc_write $fd $opcode $key $value $extras $opaque
+    flush $fd
+    mc_read $fd
+}
+
+# The status, the flags in the extras, the key and the value of a response
+proc mc_result r {
+    set flags {}
+    if {[string length [lindex $r 3]] == 4} {
+        binary scan [lindex $r 3] Iu flags
+    }
+    list [lindex $r 1] $flags [lindex $r 4] [lindex $r 5]
+}
+
+proc mc_set {fd key value {flags 0}} {
+    mc_call $fd 0x01 $key $value [binary format II $flags 0]
+}
+
+proc mc_incr_extras {delta initial exp} {
+    binary format WWI $delta $initial $exp
+}
+
+proc mc_incr_value r {
+    binary scan [lindex $r 5] Wu value
+    return $value
+}
+
+if {[llength $argv] == 0} {
+    main 127.0.0.1 11211
+} else {
+    main [lindex $argv 0] [lindex $argv 1]
+}
@@ -137,6 +137,36 @@ proc main {server port} {
         string match -ERR* [redis_read_retcode $fd]
     } {1}
 
+    test {Multi bulk SET/GET with a binary value} {
+        set val "a b\r\nc\x00d"
+        redis_multibulk $fd set binkey $val
+        redis_read_retcode $fd
+        redis_multibulk $fd get binkey
+        expr {[redis_bulk_read $fd] eq $val}
+    } {1}
+
+    test {Multi bulk request sent in small chunks} {
+        set req "*2\r\n\$3\r\nget\r\n\$6\r\nbinkey\r\n"
+        foreach chunk [regexp -all -inline {.{1,5}} $req] {
+            puts -nonewline $fd $chunk
+            flush $fd
+            after 10
+        }
+        string length [redis_bulk_read $fd]
+    } {8}
+
+    test {Multi bulk and inline commands pipelining} {
+        puts -nonewline $fd "*3\r\n\$3\r\nSET\r\n\$2\r\nk2\r\n\$2\r\nab\r\nGET k2\r\n*1\r\n\$4\r\nPING\r\n"
+        flush $fd
+        set res {}
+        append res [string match +OK* [redis_read_retcode $fd]]
+        append res [redis_bulk_read $fd]
+        append res [string match +PONG* [redis_read_retcode $fd]]
+        redis_del $fd k2
+        redis_del $fd binkey
+        format $res
+    } {1ab1}
+
     test {Basic LPUSH, RPUSH, LLENGTH, LINDEX} {
         redis_lpush $fd mylist a
         redis_lpush $fd mylist b
@@ -400,6 +430,15 @@ proc redis_writenl {fd buf} {
     flush $fd
 }
 
+proc redis_multibulk {fd args} {
+    set buf "*[llength $args]\r\n"
+    foreach arg $args {
+        append buf "\$[string length $arg]\r\n$arg\r\n"
+    }
+    redis_write $fd $buf
+    flush $fd
+}
+
 proc redis_readnl {fd len} {
     set buf [read $fd $len]
     read $fd 2 ; # discard CR LF